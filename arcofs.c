@@ -15,10 +15,36 @@
 #include <linux/uaccess.h>
 #include <linux/delay.h>
 #include <linux/compiler.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/list_sort.h>
+#include <linux/workqueue.h>
+#include <linux/percpu_counter.h>
+#include <linux/fileattr.h>
+#include <linux/lz4.h>
 
 #define ARCOFS_VERSION "0.1"
 #define ARCOFS_BLOCK_SIZE 1024
 #define ARCOFS_MAGIC   0x27266673 // 0x6673 is the ascii of 'fs'
+#define ARCOFS_N_BLOCKS 8 // 每个inode的直接块数量
+#define ARCOFS_MAX_FILE_SIZE (ARCOFS_N_BLOCKS * ARCOFS_BLOCK_SIZE)
+#define ARCOFS_INODES_PER_BLOCK (ARCOFS_BLOCK_SIZE / sizeof(struct arcofs_inode))
+#define ARCOFS_ASYNC_RECLAIM_BLOCKS 4 // 占用块数达到这个值的文件放到后台释放
+#define ARCOFS_FIRST_DATA_BLOCK 5     // 0~4是保留块、super block、bytemap和inode表
+#define ARCOFS_BMAP_MAX 255           // block bytemap每项: 1是空闲, v(v>=2)表示被v-1个文件引用(reflink)
+
+// 透明压缩: 压缩文件的数据以cluster为单位用LZ4压缩
+#define ARCOFS_CLUSTER_BLOCKS 4
+#define ARCOFS_CLUSTER_SIZE (ARCOFS_CLUSTER_BLOCKS * ARCOFS_BLOCK_SIZE)
+#define ARCOFS_CLUSTER_MAGIC 0x00347a6c // "lz4"
+#define ARCOFS_COMPR_FL 0x0001        // i_flags: 文件数据压缩存放
+#define ARCOFS_SB_COMPRESS 0x0001     // s_flags: 新建文件默认压缩(mkarcofs -c)
+#define ARCOFS_STATE_CLEAN 0x0001     // s_state: 正常卸载, super block里的计数可信
+
+// 挂载选项
+#define ARCOFS_MOUNT_DISCARD 0x0001 // 释放块后异步下发discard
+#define ARCOFS_MOUNT_COMPRESS 0x0002 // 新建的文件使用压缩
+#define ARCOFS_DISCARD_DELAY HZ     // 攒一批释放的块再合并下发
 
 #ifndef __CHECKER__
 extern void *__stack_chk_guard;
@@ -38,7 +64,11 @@ struct arcofs_super_block {
     int s_free_inodes_count;
     int s_blocks_count;
     int s_free_blocks_count;
-    char pad[1004];
+    int s_last_orphan;  // orphan链表头: 已unlink但还没释放的inode
+    int s_blocks_per_group; // 每个分配组的块数, 0表示老镜像(整个卷一个组)
+    int s_flags;
+    int s_state;        // 挂载期间清掉ARCOFS_STATE_CLEAN, 正常卸载时再置上
+    char pad[988];
 };
 
 struct arcofs_inode {
@@ -46,18 +76,148 @@ struct arcofs_inode {
     /*04*/ int i_size;
     /*08*/ int i_block[8];
     /*40*/ char filename[12];
-    /*52*/ char pad[12];
+    /*52*/ int i_next_orphan; // orphan链表里的下一个ino
+    /*56*/ int i_flags;
+    /*60*/ char pad[4];
+};
+
+// 压缩文件的cluster map: 第c个cluster占i_block[c*4 ~ c*4+3]
+//   4项全0: 空洞
+//   4项都用了: 压不下来, 原样存放
+//   只用了前k(<4)项: LZ4压缩数据, 第一个块开头是arcofs_cluster_head
+struct arcofs_cluster_head {
+    unsigned int c_magic;
+    int c_size;         // 压缩数据的字节数, 不含头
 };
 
 struct arcofs_bytemap {
     unsigned char idx[1024];
 };
 
+// 分配组: 每个组有自己的bytemap块和锁, 不同CPU上的分配落到不同的组
+// 组g管理[g*bpg, (g+1)*bpg)这些块, 组0的bytemap是第2块, 其他组的bytemap是组内第一块
+struct arcofs_group_info {
+    spinlock_t g_lock;
+    struct buffer_head *g_bh;   // 第一次用到这个组时才读进来
+};
+
+// 等待discard的一段连续空闲块
+struct arcofs_discard_extent {
+    struct list_head list;
+    int start;
+    int len;
+};
+
 struct arcofs_sb_info {
     int version;
+    struct super_block *s_sb;
+    struct buffer_head *s_sbh;
     struct arcofs_super_block *s_as;
+    unsigned long s_mount_opt;
+    // 分配组
+    int s_total_blocks;                  // 卷上的总块数, 包括元数据块
+    int s_blocks_per_group;
+    int s_groups_count;
+    struct arcofs_group_info *s_groups;
+    spinlock_t s_imap_lock;              // 保护inode bytemap
+    struct buffer_head *s_imap_bh;       // 和组的bytemap一样按需读入
+    struct percpu_counter s_freeblocks_counter;
+    struct percpu_counter s_freeinodes_counter;
+    // online discard
+    spinlock_t s_discard_lock;
+    struct list_head s_discard_list;     // 已释放、还没下发discard的extent
+    struct delayed_work s_discard_work;
+    unsigned long *s_discard_busy;       // 正在discard的块, 分配时要跳过; 相邻的组可能共用一个word, 只能按位原子操作
+    // unlink之后的延迟释放
+    struct mutex s_orphan_lock;          // 保护superblock和raw inode里的orphan链表
+    struct work_struct s_reclaim_work;
+    DECLARE_BITMAP(s_reclaim_pending, ARCOFS_INODES_PER_BLOCK); // 等待后台释放的inode
+    // 透明压缩
+    struct mutex s_compress_lock;        // 保护压缩用的工作区
+    void *s_lz4_wmem;
+    char *s_cbuf;                        // 压缩输出, 最多CLUSTER_BLOCKS-1个块
 };
 
+static inline int arcofs_is_compressed(struct arcofs_inode *raw_inode)
+{
+    return raw_inode->i_flags & ARCOFS_COMPR_FL;
+}
+
+// 逻辑块iblock是否有数据(SEEK_DATA/SEEK_HOLE用), 压缩文件按整个cluster判断
+static inline int arcofs_block_mapped(struct arcofs_inode *raw_inode, int iblock)
+{
+    if (arcofs_is_compressed(raw_inode))
+        iblock -= iblock % ARCOFS_CLUSTER_BLOCKS;
+    return raw_inode->i_block[iblock] != 0;
+}
+
+static inline int arcofs_block_group(struct arcofs_sb_info *sbi, int block)
+{
+    return block / sbi->s_blocks_per_group;
+}
+
+// 组g的bytemap所在的块号
+static inline int arcofs_group_map_block(struct arcofs_sb_info *sbi, int g)
+{
+    return g ? g * sbi->s_blocks_per_group : 2;
+}
+
+// 组g里第一个可以分配给文件的块
+static inline int arcofs_group_first_data(struct arcofs_sb_info *sbi, int g)
+{
+    return g ? g * sbi->s_blocks_per_group + 1 : ARCOFS_FIRST_DATA_BLOCK;
+}
+
+static inline int arcofs_group_end(struct arcofs_sb_info *sbi, int g)
+{
+    return min((g + 1) * sbi->s_blocks_per_group, sbi->s_total_blocks);
+}
+
+// block在所属组bytemap里的那一项
+static inline unsigned char *arcofs_group_entry(struct arcofs_sb_info *sbi, int block)
+{
+    int g = arcofs_block_group(sbi, block);
+
+    return (unsigned char *)sbi->s_groups[g].g_bh->b_data + (block - g * sbi->s_blocks_per_group);
+}
+
+// 按需读入一个bytemap块, 挂载时不读, 这样挂载时间和卷大小无关
+// 会睡眠, 不能在g_lock/s_imap_lock里调用; 两个线程同时读时只留一份
+static int arcofs_load_map(struct arcofs_sb_info *sbi, struct buffer_head **pbh, int block)
+{
+    struct buffer_head *bh;
+
+    if (smp_load_acquire(pbh))
+        return 0;
+    bh = sb_bread(sbi->s_sb, block);
+    if (!bh) {
+        printk("arco-fs: unable to read map block %d\n", block);
+        return -EIO;
+    }
+    if (cmpxchg(pbh, NULL, bh))
+        brelse(bh);
+    return 0;
+}
+
+static inline int arcofs_load_group(struct arcofs_sb_info *sbi, int g)
+{
+    return arcofs_load_map(sbi, &sbi->s_groups[g].g_bh, arcofs_group_map_block(sbi, g));
+}
+
+static inline int arcofs_load_imap(struct arcofs_sb_info *sbi)
+{
+    return arcofs_load_map(sbi, &sbi->s_imap_bh, 3);
+}
+
+// 块是否被多个文件共享(reflink), 写之前要先复制一份
+// 读不出bytemap时按共享处理, 宁可多复制一次也不能原地改
+static inline int arcofs_block_shared(struct arcofs_sb_info *sbi, int block)
+{
+    if (arcofs_load_group(sbi, arcofs_block_group(sbi, block)))
+        return 1;
+    return READ_ONCE(*arcofs_group_entry(sbi, block)) > 2;
+}
+
 /*
  * #2
  * 函数声明 
@@ -66,6 +226,8 @@ int arcofs_writepage(struct page *page, struct writeback_control *wbc);
 static int arcofs_readpage(struct file *file, struct page *page);
 static sector_t arcofs_bmap(struct address_space *mapping, sector_t block);
 int arcofs_get_block(struct inode * inode, sector_t block, struct buffer_head *bh, int create);
+int arcofs_alloc_block(struct inode* inode);
+static struct buffer_head *arcofs_cow_block(struct inode *inode, struct arcofs_inode *raw_inode, int iblock);
 
 
 void arcofs_set_inode(struct inode *inode, dev_t rdev);
@@ -74,13 +236,30 @@ static int arcofs_mknod(struct mnt_idmap *idmap, struct inode *dir, struct dentr
 static int arcofs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
 static struct dentry *arcofs_lookup(struct inode * dir, struct dentry *dentry, unsigned int flags);
 static int arcofs_unlink(struct inode * dir, struct dentry *dentry);
-//static int arcofs_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat); // ubuntu16内核不一致，暂不实现
+static int arcofs_setattr(struct mnt_idmap *idmap, struct dentry *dentry, struct iattr *attr);
+static int arcofs_getattr(struct mnt_idmap *idmap, const struct path *path, struct kstat *stat, u32 request_mask, unsigned int query_flags);
 static int arcofs_readdir(struct file *file, struct dir_context *ctx);
 
 static ssize_t arcofs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos);
 static ssize_t arcofs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos);
+static loff_t arcofs_file_llseek(struct file *file, loff_t offset, int whence);
+static int arcofs_fileattr_get(struct dentry *dentry, struct fileattr *fa);
+static int arcofs_fileattr_set(struct mnt_idmap *idmap, struct dentry *dentry, struct fileattr *fa);
+static loff_t arcofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags);
+static ssize_t arcofs_compr_read(struct super_block *sb, struct arcofs_inode *raw_inode, char __user *buf, size_t len, loff_t pos);
+static ssize_t arcofs_compr_write(struct inode *inode, struct arcofs_inode *raw_inode, const char __user *buf, size_t len, loff_t pos);
+static int arcofs_compr_truncate(struct inode *inode, struct arcofs_inode *raw_inode, loff_t newsize);
 
 static int arcofs_statfs(struct dentry *dentry, struct kstatfs *buf);
+static int arcofs_sync_fs(struct super_block *sb, int wait);
+static void arcofs_evict_inode(struct inode *inode);
+static void arcofs_put_super(struct super_block *sb);
+static int arcofs_remount(struct super_block *sb, int *flags, char *data);
+static void arcofs_orphan_cleanup(struct super_block *sb);
+static int arcofs_show_options(struct seq_file *seq, struct dentry *root);
+static long arcofs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static void arcofs_discard_queue(struct super_block *sb, int block);
+static int arcofs_trim_fs(struct super_block *sb, struct fstrim_range *range);
 
 struct arcofs_inode* arcofs_raw_inode(struct super_block *sb, int ino, struct buffer_head **bh);
 struct inode *arcofs_iget(struct super_block *sb, unsigned long ino);
@@ -110,7 +289,7 @@ const struct inode_operations arcofs_dir_inode_operations = {
     // .rmdir		= arcofs_rmdir,
 	.mknod		= arcofs_mknod,
 	// .rename		= arcofs_rename,
-    // .getattr	= arcofs_getattr,  // 这个指针类型不匹配, 看下是不是4.15内核改了(果然!ubuntu16内核里头文件不一样, 这个不管了
+    .getattr	= arcofs_getattr,
 	// .tmpfile	= arcofs_tmpfile,
 };
 const struct file_operations arcofs_dir_operations = {
@@ -118,15 +297,19 @@ const struct file_operations arcofs_dir_operations = {
 	.read		    = generic_read_dir,
     .iterate_shared	= arcofs_readdir,
 	.fsync		    = generic_file_fsync,
+    .unlocked_ioctl = arcofs_ioctl, // fstrim是对挂载点目录发FITRIM
+    .compat_ioctl   = compat_ptr_ioctl,
 };
 
 // file操作结构
  const struct inode_operations arcofs_file_inode_operations = {
-// 	.setattr	= arcofs_setattr,
-// 	.getattr	= arcofs_getattr,
+	.setattr	= arcofs_setattr,
+	.getattr	= arcofs_getattr,
+	.fileattr_get	= arcofs_fileattr_get,
+	.fileattr_set	= arcofs_fileattr_set,
  };
  const struct file_operations arcofs_file_operations = {
- 	.llseek		= generic_file_llseek,
+ 	.llseek		= arcofs_file_llseek,
     .read       = arcofs_read,
     .write      = arcofs_write,
 // 	.read_iter	= generic_file_read_iter,
@@ -134,6 +317,9 @@ const struct file_operations arcofs_dir_operations = {
  	.mmap		= generic_file_mmap,
     .open		= dquot_file_open,
  	.fsync		= generic_file_fsync,
+    .unlocked_ioctl = arcofs_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
+    .remap_file_range = arcofs_remap_file_range, // FICLONE, copy_file_range也走这里
 // .splice_read	= generic_file_splice_read,
  };
 
@@ -142,10 +328,12 @@ static const struct super_operations arcofs_sops = {
 	// .alloc_inode	= arcofs_alloc_inode,
 	// .destroy_inode	= arcofs_destroy_inode,
 	// .write_inode	= arcofs_write_inode,
-	// .evict_inode	= arcofs_evict_inode,
-	// .put_super	= arcofs_put_super,
+	.evict_inode	= arcofs_evict_inode,
+	.put_super	= arcofs_put_super,
 	.statfs		= arcofs_statfs,
-	// .remount_fs	= arcofs_remount,
+	.sync_fs	= arcofs_sync_fs,
+	.show_options	= arcofs_show_options,
+	.remount_fs	= arcofs_remount,
 };
 
 
@@ -173,8 +361,52 @@ static sector_t arcofs_bmap(struct address_space *mapping, sector_t block)
 
 int arcofs_get_block(struct inode * inode, sector_t block, struct buffer_head *bh, int create)
 {
+    int phys;
+    struct buffer_head *ibh, *bhx;
+    struct arcofs_inode *raw_inode;
+
     printk("arco-fs: try get block %lld\n", block);
-    map_bh(bh, inode->i_sb, block);
+    if (block >= ARCOFS_N_BLOCKS)
+        return create ? -EFBIG : 0;
+
+    raw_inode = arcofs_raw_inode(inode->i_sb, inode->i_ino, &ibh);
+    if (!raw_inode)
+        return -EIO;
+
+    // 压缩文件的逻辑块和物理块不是一一对应的, 不能直接映射
+    if (arcofs_is_compressed(raw_inode)) {
+        brelse(ibh);
+        return -EOPNOTSUPP;
+    }
+
+    // 逻辑块映射到i_block, 0是空洞: 只读时保持unmapped, 上层会填0
+    phys = raw_inode->i_block[block];
+    if (!phys && create) {
+        phys = arcofs_alloc_block(inode);
+        if (!phys) {
+            brelse(ibh);
+            return -ENOSPC;
+        }
+        raw_inode->i_block[block] = phys;
+        inode->i_blocks += ARCOFS_BLOCK_SIZE >> 9;
+        mark_buffer_dirty(ibh);
+        set_buffer_new(bh);
+    }
+    else if (phys && create && arcofs_block_shared(inode->i_sb->s_fs_info, phys)) {
+        // 共享的块要写, 先复制出一份自己的
+        bhx = arcofs_cow_block(inode, raw_inode, block);
+        if (IS_ERR(bhx)) {
+            brelse(ibh);
+            return PTR_ERR(bhx);
+        }
+        phys = bhx->b_blocknr;
+        brelse(bhx);
+        mark_buffer_dirty(ibh);
+    }
+    if (phys)
+        map_bh(bh, inode->i_sb, phys);
+
+    brelse(ibh);
     return 0;
 }
 
@@ -208,13 +440,18 @@ struct inode *arcofs_new_inode(const struct inode *dir, umode_t mode, const char
 	struct arcofs_sb_info *sbi = sb->s_fs_info;
 	struct inode *inode = new_inode(sb);
 
-    struct buffer_head* inode_bytemap_block;
-    inode_bytemap_block = sb_bread(sb, 3); // block number of inode bytemap
-    unsigned char *inode_bytemap_arr = (unsigned char*)inode_bytemap_block->b_data;
+    if (!inode)
+        return NULL;
+    if (arcofs_load_imap(sbi)) {
+        iput(inode);
+        return NULL;
+    }
+
+    unsigned char *inode_bytemap_arr = (unsigned char*)sbi->s_imap_bh->b_data;
 
     // 在inode bytemap中 找到一个空闲的inode
+    spin_lock(&sbi->s_imap_lock);
     for (i = 0; i < sbi->s_as->s_inodes_count; i++) {
-        printk("arco-fs: inode[%d] state=%d\n", i, inode_bytemap_arr[i]);
         if (inode_bytemap_arr[i] == 1) {
             printk("arco-fs: find inode[%d] free\n", i);
             inode_bytemap_arr[i] = 2;
@@ -222,6 +459,13 @@ struct inode *arcofs_new_inode(const struct inode *dir, umode_t mode, const char
             break;
         }
     }
+    spin_unlock(&sbi->s_imap_lock);
+    if (i == sbi->s_as->s_inodes_count) {
+        printk("arco-fs: no free inode\n");
+        iput(inode);
+        return NULL;
+    }
+    percpu_counter_dec(&sbi->s_freeinodes_counter);
     inode->i_blocks = 0;
     inode->i_mode = S_IFREG; // create出来的一律是file, mkdir出来的才是dir
 
@@ -230,13 +474,15 @@ struct inode *arcofs_new_inode(const struct inode *dir, umode_t mode, const char
     inode_table_block = sb_bread(sb, 4); // block number of inode bytemap
     struct arcofs_inode *inode_table_arr = (struct arcofs_inode*)inode_table_block->b_data;
     inode_table_arr[i].i_mode = S_IFREG;
+    inode_table_arr[i].i_flags = (sbi->s_mount_opt & ARCOFS_MOUNT_COMPRESS) ? ARCOFS_COMPR_FL : 0;
     strcpy(inode_table_arr[i].filename, name); // 用
     // 没有加入dentry的动作
 
 	// insert_inode_hash(inode);
     mark_inode_dirty(inode);
-    mark_buffer_dirty(inode_bytemap_block);
+    mark_buffer_dirty(sbi->s_imap_bh);
     mark_buffer_dirty(inode_table_block);
+    brelse(inode_table_block);
 
     return inode;
 }
@@ -266,6 +512,9 @@ static int arcofs_mknod(struct mnt_idmap *idmap, struct inode * dir, struct dent
 		mark_inode_dirty(inode);
         error = arcofs_add_nondir(dentry, inode);
 	}
+    else {
+        error = -ENOSPC;
+    }
 	return error;
 }
 
@@ -289,7 +538,7 @@ ino_t arcofs_inode_by_name(struct inode* dir, struct dentry *dentry)
     struct arcofs_inode* inode_table_arr = (struct arcofs_inode*)bh->b_data;
     for (i = 0; i < sbi->s_as->s_inodes_count; i++) {
         printk("arco-fs: match [%s] [%s]", inode_table_arr[i].filename, dentry->d_name.name);
-        if (strcmp(inode_table_arr[i].filename, dentry->d_name.name) == 0) {
+        if (inode_table_arr[i].i_mode != 0 && strcmp(inode_table_arr[i].filename, dentry->d_name.name) == 0) {
             ino = i + 1;
             printk("arco-fs: file[%s] ino=%d", dentry->d_name.name, ino);
             brelse(bh);
@@ -315,50 +564,241 @@ static struct dentry *arcofs_lookup(struct inode* dir, struct dentry *dentry, un
 	return NULL;
 }
 
-static void arcofs_free_file(struct inode *inode, struct arcofs_inode *raw_inode, int rewrite)
+// 释放blocks[0~n)里的数据块并清0, 返回真正变成空闲的块数; 共享的块只减引用计数
+// 整批处理: 连续落在同一个组里的块只加一次组锁, 只标记一次dirty, discard也只踢一次
+static int arcofs_free_block_list(struct super_block *sb, int *blocks, int n)
 {
-    int i;
-    struct super_block *sb = inode->i_sb;
-    struct buffer_head *bh2, *bh3;
+    int i, blk, g, cur = -1, freed = 0;
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+
+    // 稀疏文件中间可能有空洞, 每一项都要过一遍
+    for (i = 0; i < n; i++) {
+        blk = blocks[i];
+        if (blk == 0) continue;
+        if (blk >= sbi->s_total_blocks) {
+            printk("arco-fs: bad block %d\n", blk);
+            blocks[i] = 0;
+            continue;
+        }
+
+        g = arcofs_block_group(sbi, blk);
+        if (g != cur) {
+            if (cur >= 0) {
+                mark_buffer_dirty(sbi->s_groups[cur].g_bh);
+                spin_unlock(&sbi->s_groups[cur].g_lock);
+                cur = -1;
+            }
+            // 读不出bytemap的块只能先漏掉, 下次脏挂载重建计数
+            if (arcofs_load_group(sbi, g)) {
+                blocks[i] = 0;
+                continue;
+            }
+            cur = g;
+            spin_lock(&sbi->s_groups[cur].g_lock);
+        }
+        blocks[i] = 0;
+        // 还有别的文件引用着(reflink), 只减引用计数
+        if (*arcofs_group_entry(sbi, blk) > 2) {
+            (*arcofs_group_entry(sbi, blk))--;
+            continue;
+        }
+        *arcofs_group_entry(sbi, blk) = 1;
+        printk("arco-fs: block[%d] once occupied, now free\n", blk);
+        if (sbi->s_mount_opt & ARCOFS_MOUNT_DISCARD)
+            arcofs_discard_queue(sb, blk);
+        freed++;
+    }
+    if (cur >= 0) {
+        mark_buffer_dirty(sbi->s_groups[cur].g_bh);
+        spin_unlock(&sbi->s_groups[cur].g_lock);
+    }
+
+    if (freed) {
+        percpu_counter_add(&sbi->s_freeblocks_counter, freed);
+        if (sbi->s_mount_opt & ARCOFS_MOUNT_DISCARD)
+            queue_delayed_work(system_unbound_wq, &sbi->s_discard_work, ARCOFS_DISCARD_DELAY);
+    }
+    return freed;
+}
+
+// 释放i_block[first, last)这些数据块, 返回释放的块数
+static int arcofs_free_blocks(struct super_block *sb, struct arcofs_inode *raw_inode, int first, int last)
+{
+    return arcofs_free_block_list(sb, &raw_inode->i_block[first], last - first);
+}
+
+// 给blocks[0~n)里的数据块各加一个引用(reflink), 有块引用数满了就全部撤销
+static int arcofs_share_block_list(struct super_block *sb, const int *blocks, int n)
+{
+    int i, blk, g, cur = -1, err = 0;
+    int undo[ARCOFS_N_BLOCKS] = {0};
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+
+    for (i = 0; i < n; i++) {
+        blk = blocks[i];
+        if (blk == 0) continue;
+        if (blk >= sbi->s_total_blocks) {
+            err = -EIO;
+            break;
+        }
+
+        g = arcofs_block_group(sbi, blk);
+        if (g != cur) {
+            if (cur >= 0) {
+                mark_buffer_dirty(sbi->s_groups[cur].g_bh);
+                spin_unlock(&sbi->s_groups[cur].g_lock);
+                cur = -1;
+            }
+            err = arcofs_load_group(sbi, g);
+            if (err)
+                break;
+            cur = g;
+            spin_lock(&sbi->s_groups[cur].g_lock);
+        }
+        if (*arcofs_group_entry(sbi, blk) >= ARCOFS_BMAP_MAX) {
+            err = -EMLINK;
+            break;
+        }
+        (*arcofs_group_entry(sbi, blk))++;
+        undo[i] = blk;
+    }
+    if (cur >= 0) {
+        mark_buffer_dirty(sbi->s_groups[cur].g_bh);
+        spin_unlock(&sbi->s_groups[cur].g_lock);
+    }
+
+    if (err)
+        arcofs_free_block_list(sb, undo, n);
+    return err;
+}
+
+// 释放文件占用的资源: 数据块和inode
+static void arcofs_free_file(struct super_block *sb, unsigned long ino, struct arcofs_inode *raw_inode)
+{
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
 
     // 清除标志位
     raw_inode->i_mode = 0;
     raw_inode->i_size = 0;
-    inode->i_size = 0;
+    raw_inode->i_flags = 0;
+    memset(raw_inode->filename, 0, sizeof(raw_inode->filename));
 
     // 释放block bytemap
-    bh2 = sb_bread(sb, 2);
-    unsigned char* block_bytemap_arr = (unsigned char*)bh2->b_data;
-    for (i = 0; i < 8; i++) {
-        if (raw_inode->i_block[i] == 0) break;
-        block_bytemap_arr[raw_inode->i_block[i]] = 1;
-        raw_inode->i_block[i] = 0;
-        printk("arco-fs: block[%d] once occupied, now free\n", raw_inode->i_block[i]);
+    arcofs_free_blocks(sb, raw_inode, 0, ARCOFS_N_BLOCKS);
+
+    // 释放inode bytemap
+    if (arcofs_load_imap(sbi))
+        return;
+    unsigned char* inode_bytemap_arr = (unsigned char*)sbi->s_imap_bh->b_data;
+    spin_lock(&sbi->s_imap_lock);
+    inode_bytemap_arr[ino - 1] = 1;
+    spin_unlock(&sbi->s_imap_lock);
+    percpu_counter_inc(&sbi->s_freeinodes_counter);
+    printk("arco-fs: inode[%lu] once occupied, now free\n", ino - 1);
+
+    mark_buffer_dirty(sbi->s_imap_bh);
+}
+
+// 把ino挂到superblock上orphan链表的头部, 调用者持有s_orphan_lock
+static void arcofs_orphan_add(struct super_block *sb, unsigned long ino, struct arcofs_inode *raw_inode)
+{
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+
+    printk("arco-fs: inode %lu add to orphan list\n", ino);
+    raw_inode->i_next_orphan = sbi->s_as->s_last_orphan;
+    sbi->s_as->s_last_orphan = ino;
+    mark_buffer_dirty(sbi->s_sbh);
+}
+
+// 把ino从orphan链表里摘掉, 调用者持有s_orphan_lock
+static void arcofs_orphan_del(struct super_block *sb, unsigned long ino, struct arcofs_inode *raw_inode)
+{
+    int n = 0;
+    unsigned long cur;
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+    struct arcofs_inode *prev;
+    struct buffer_head *bh;
+
+    if (sbi->s_as->s_last_orphan == ino) {
+        sbi->s_as->s_last_orphan = raw_inode->i_next_orphan;
+        mark_buffer_dirty(sbi->s_sbh);
+    }
+    else {
+        // 单向链表, 要找到前一个节点; inode表只有一个块, 链表很短
+        cur = sbi->s_as->s_last_orphan;
+        while (cur && n++ < sbi->s_as->s_inodes_count) {
+            prev = arcofs_raw_inode(sb, cur, &bh);
+            if (!prev)
+                break;
+            cur = prev->i_next_orphan;
+            if (cur == ino) {
+                prev->i_next_orphan = raw_inode->i_next_orphan;
+                mark_buffer_dirty(bh);
+                cur = 0;
+            }
+            brelse(bh);
+        }
     }
-    mark_buffer_dirty(bh2);
+    raw_inode->i_next_orphan = 0;
+}
+
+// 真正释放一个已经unlink且没人再打开的inode, 释放完才摘出orphan链表
+static void arcofs_reclaim_inode(struct super_block *sb, unsigned long ino)
+{
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+    struct buffer_head *bh;
+    struct arcofs_inode *raw_inode;
 
-    if (rewrite) return; // 如果只是重写文件调用的释放资源, 不释放inode bytemap
+    raw_inode = arcofs_raw_inode(sb, ino, &bh);
+    if (!raw_inode)
+        return;
 
-    // 释放inode bytemap
-    bh3 = sb_bread(sb, 3);
-    unsigned char* inode_bytemap_arr = (unsigned char*)bh3->b_data;
-    inode_bytemap_arr[inode->i_ino - 1] = 1;
-    printk("arco-fs: inode[%lu] once occupied, now free\n", inode->i_ino - 1);
+    printk("arco-fs: reclaim inode %lu\n", ino);
+    mutex_lock(&sbi->s_orphan_lock);
+    arcofs_free_file(sb, ino, raw_inode);
+    arcofs_orphan_del(sb, ino, raw_inode);
+    mutex_unlock(&sbi->s_orphan_lock);
+
+    mark_buffer_dirty(bh);
+    brelse(bh);
+}
+
+// 后台释放大文件, evict_inode只负责把ino记到s_reclaim_pending里
+static void arcofs_reclaim_work(struct work_struct *work)
+{
+    unsigned long i;
+    struct arcofs_sb_info *sbi = container_of(work, struct arcofs_sb_info, s_reclaim_work);
 
-    mark_buffer_dirty(bh3);
+    for_each_set_bit(i, sbi->s_reclaim_pending, ARCOFS_INODES_PER_BLOCK) {
+        if (test_and_clear_bit(i, sbi->s_reclaim_pending))
+            arcofs_reclaim_inode(sbi->s_sb, i + 1);
+        cond_resched();
+    }
 }
 
 static int arcofs_unlink(struct inode * dir, struct dentry *dentry)
 {
     printk("arco-fs: execute unlink\n");
     struct inode *inode = d_inode(dentry);
+    struct super_block *sb = inode->i_sb;
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
     struct buffer_head *bh;
-    struct arcofs_inode *raw_inode = arcofs_raw_inode(inode->i_sb, inode->i_ino, &bh);
-
-    // 释放文件占用的资源
-    arcofs_free_file(inode, raw_inode, 0);
+    struct arcofs_inode *raw_inode = arcofs_raw_inode(sb, inode->i_ino, &bh);
+
+    if (!raw_inode)
+        return -EIO;
+
+    // unlink只摘掉名字, 文件可能还被打开着, 数据块留到evict_inode再释放
+    // 最后一个link没了就先挂上orphan链表, 掉电后挂载时还能找回来释放
+    mutex_lock(&sbi->s_orphan_lock);
+    memset(raw_inode->filename, 0, sizeof(raw_inode->filename));
+    if (inode->i_nlink == 1)
+        arcofs_orphan_add(sb, inode->i_ino, raw_inode);
+    mutex_unlock(&sbi->s_orphan_lock);
+    mark_buffer_dirty(bh);
+    brelse(bh);
 
-    // 减少vfs层面的引用？不懂
+    inode_set_ctime_current(inode);
     inode_dec_link_count(inode);
 
     return 0;
@@ -383,7 +823,8 @@ static int arcofs_readdir(struct file *file, struct dir_context *ctx)
     struct arcofs_inode *inode_table_arr = (struct arcofs_inode*)bh->b_data;
     // 并不一定是连续分布的, 所以每个都要过一遍
     for (i = 0; i < sbi->s_as->s_inodes_count; i++) {
-        if (inode_table_arr[i].i_mode != 0) {
+        // 已经unlink但还没释放的inode名字被清掉了, 跳过
+        if (inode_table_arr[i].i_mode != 0 && inode_table_arr[i].filename[0] != '\0') {
             printk("arco-fs: inode[%d] filename:%s\n", i, inode_table_arr[i].filename);
             unsigned l = strnlen(inode_table_arr[i].filename, sizeof(((struct arcofs_inode*)NULL)->filename));
             // 下面的参数i+1就是文件的inode号
@@ -402,257 +843,1365 @@ static ssize_t arcofs_read(struct file *filp, char __user *buf, size_t len, loff
 {
     printk("arco-fs: execute read. len=%ld f_flags=0x%x ppos=%lld\n", len, filp->f_flags, *ppos);
 
-    int i, read_len, read_offset = 0;
-    char pot[ARCOFS_BLOCK_SIZE * 8];
-    char *kbuf = pot;
+    int iblock, offset, chunk, phys;
+    loff_t pos = *ppos;
+    size_t done = 0;
+    ssize_t err = 0;
     struct inode* inode = filp->f_mapping->host;
     struct super_block* sb = inode->i_sb;
     struct arcofs_inode* raw_inode;
-    struct buffer_head* bh;
+    struct buffer_head *bh, *bhx;
 
     // 查找inode的iblock
     raw_inode = arcofs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+    if (!raw_inode)
+        return -EIO;
+
+    inode_lock_shared(inode);
     // 判断文件是否读完
-    if (*ppos == raw_inode->i_size) {
+    if (pos >= raw_inode->i_size) {
         printk("arco-fs: arrive file end\n");
-        return 0;
+        goto out;
+    }
+    if (len > raw_inode->i_size - pos)
+        len = raw_inode->i_size - pos;
+
+    if (arcofs_is_compressed(raw_inode)) {
+        err = arcofs_compr_read(sb, raw_inode, buf, len, pos);
+        if (err > 0) {
+            done = err;
+            pos += done;
+        }
+        goto out;
     }
 
-    // 查找这个inode的每个block, 把数据拷贝到kbuf中
-    for (i = 0; i < 8; i++) {
-        if (raw_inode->i_block[i] == 0) {
-            printk("arco-fs: this file hasn't alloc i_block[%d]\n", i);
-            break;
+    // 按块拷贝到用户态, 不再经过栈上的8kb中转
+    while (done < len) {
+        iblock = pos / ARCOFS_BLOCK_SIZE;
+        offset = pos % ARCOFS_BLOCK_SIZE;
+        chunk = min_t(size_t, ARCOFS_BLOCK_SIZE - offset, len - done);
+        phys = raw_inode->i_block[iblock];
+
+        if (phys == 0) {
+            // 空洞: 没分配过块, 不访问设备直接填0
+            if (clear_user(buf + done, chunk)) {
+                err = -EFAULT;
+                break;
+            }
         }
         else {
-            // 计算本次要读的字节数
-            read_len = (raw_inode->i_size >= (i + 1) * 1024) ? 1024 : raw_inode->i_size % 1024;
-            printk("arco-fs: file i_size=%d i_block[0]=%d read_len=%d\n", raw_inode->i_size, raw_inode->i_block[0], read_len);
-            bh = sb_bread(sb, raw_inode->i_block[i]);
-            memcpy(kbuf + read_offset, bh->b_data, read_len);
-            read_offset += read_len;
+            bhx = sb_bread(sb, phys);
+            if (!bhx) {
+                err = -EIO;
+                break;
+            }
+            if (copy_to_user(buf + done, bhx->b_data + offset, chunk)) {
+                brelse(bhx);
+                err = -EFAULT;
+                break;
+            }
+            brelse(bhx);
         }
+        done += chunk;
+        pos += chunk;
     }
 
-    printk("arco-fs: read buf:%s\n", kbuf);
-    if (copy_to_user(buf, kbuf, raw_inode->i_size)) {
-        return -EFAULT;
-    }
+out:
+    inode_unlock_shared(inode);
+    brelse(bh);
+    if (done == 0 && err)
+        return err;
 
-    *ppos += raw_inode->i_size;
-    return raw_inode->i_size;
+    *ppos = pos;
+    return done;
 }
 
 int arcofs_alloc_block(struct inode* inode)
 {
-    int i, block_number = 0;
+    int i, g, n, block_number = 0;
     struct super_block* sb = inode->i_sb;
     struct arcofs_sb_info *sbi = sb->s_fs_info;
-    struct buffer_head* bh;
-
-    bh = sb_bread(sb, 2);
-    unsigned char *block_bytemap_arr = (unsigned char*)bh->b_data;
+    struct arcofs_group_info *grp;
+
+    // 从当前CPU对应的组开始找, 多核同时创建文件时各自落在不同的组里, 不抢同一把锁
+    g = raw_smp_processor_id() % sbi->s_groups_count;
+    for (n = 0; n < sbi->s_groups_count && !block_number; n++, g = (g + 1) % sbi->s_groups_count) {
+        grp = &sbi->s_groups[g];
+        if (arcofs_load_group(sbi, g))
+            continue;
+
+        // 查找组的block bytemap, 分配一块没使用的block
+        // 还在等discard的块虽然是空闲的, 但不能分出去, 否则新数据会被discard掉
+        spin_lock(&grp->g_lock);
+        for (i = arcofs_group_first_data(sbi, g); i < arcofs_group_end(sbi, g); i++) {
+            if (*arcofs_group_entry(sbi, i) == 1 && !test_bit(i, sbi->s_discard_busy)) {
+                *arcofs_group_entry(sbi, i) = 2;
+                block_number = i;
+                printk("arco-fs: find block %d free in group %d\n", block_number, g);
+                break;
+            }
+        }
+        spin_unlock(&grp->g_lock);
 
-    // 查找block bytemap, 分配一块没使用的block
-    for (i = 5; i < sbi->s_as->s_blocks_count; i++) {
-        if (block_bytemap_arr[i] == 1) {
-            block_bytemap_arr[i] = 2;
-            block_number = i;
-            printk("arco-fs: find block %d free\n", block_number);
-            break;
+        if (block_number) {
+            mark_buffer_dirty(grp->g_bh);
+            percpu_counter_dec(&sbi->s_freeblocks_counter);
         }
     }
 
+    return block_number;
+}
+
+// 写时复制: 把共享的i_block[iblock]复制到新块上, 返回新块的buffer_head
+static struct buffer_head *arcofs_cow_block(struct inode *inode, struct arcofs_inode *raw_inode, int iblock)
+{
+    int phys, old = raw_inode->i_block[iblock];
+    struct super_block *sb = inode->i_sb;
+    struct buffer_head *bh, *obh;
+
+    obh = sb_bread(sb, old);
+    if (!obh)
+        return ERR_PTR(-EIO);
+    phys = arcofs_alloc_block(inode);
+    if (!phys) {
+        brelse(obh);
+        return ERR_PTR(-ENOSPC);
+    }
+    bh = sb_getblk(sb, phys);
+    if (!bh) {
+        brelse(obh);
+        arcofs_free_block_list(sb, &phys, 1);
+        return ERR_PTR(-EIO);
+    }
+
+    lock_buffer(bh);
+    memcpy(bh->b_data, obh->b_data, ARCOFS_BLOCK_SIZE);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
     mark_buffer_dirty(bh);
+    brelse(obh);
 
-    return block_number;
+    printk("arco-fs: i_block[%d] copy on write block[%d] -> block[%d]\n", iblock, old, phys);
+    raw_inode->i_block[iblock] = phys;
+    arcofs_free_block_list(sb, &old, 1);
+    return bh;
 }
 
 
 static ssize_t arcofs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos)
 {
-    printk("arco-fs: execute write. len=%ld f_flags=0x%x\n", len, filp->f_flags);
-    int i, r, alloc_block = 5, remain_len = len, write_len, block_offset = 0, write_offset = 0;
-    char pot[ARCOFS_BLOCK_SIZE * 8];
-    char *kbuf = pot;
+    printk("arco-fs: execute write. len=%ld f_flags=0x%x ppos=%lld\n", len, filp->f_flags, *ppos);
+    int iblock, offset, chunk, phys, fresh;
+    loff_t pos;
+    size_t done = 0;
+    ssize_t err = 0;
     struct inode* inode = filp->f_mapping->host;
     struct super_block* sb = inode->i_sb;
     struct buffer_head *bh, *bhx;
-    struct arcofs_inode* raw_inode  = arcofs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+    struct arcofs_inode* raw_inode;
 
-    if (len > 8 * 1024) return -ENOSPC;
+    inode_lock(inode);
+    raw_inode = arcofs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+    if (!raw_inode) {
+        inode_unlock(inode);
+        return -EIO;
+    }
 
-    if (copy_from_user(kbuf, buf, len)) return -EFAULT;
+    // 原地覆盖写, 截断由O_TRUNC/ftruncate走setattr完成
+    pos = (filp->f_flags & O_APPEND) ? raw_inode->i_size : *ppos;
 
-    printk("arco-fs: write buf:%s\n", kbuf);
+    if (pos >= ARCOFS_MAX_FILE_SIZE) {
+        printk("arco-fs: exceed file max length, exit\n");
+        err = -EFBIG;
+        goto out;
+    }
+    if (len > ARCOFS_MAX_FILE_SIZE - pos)
+        len = ARCOFS_MAX_FILE_SIZE - pos;
+
+    if (arcofs_is_compressed(raw_inode)) {
+        err = arcofs_compr_write(inode, raw_inode, buf, len, pos);
+        if (err > 0) {
+            done = err;
+            pos += done;
+        }
+        goto update;
+    }
 
+    // 逐个块写入, 只为实际写到的块分配空间, EOF之后跳过的部分保持空洞
+    while (done < len) {
+        iblock = pos / ARCOFS_BLOCK_SIZE;
+        offset = pos % ARCOFS_BLOCK_SIZE;
+        chunk = min_t(size_t, ARCOFS_BLOCK_SIZE - offset, len - done);
+        phys = raw_inode->i_block[iblock];
+        fresh = 0;
 
-    // 如果是覆盖写入模式, 需要截断文件长度(直接调用释放文件资源函数
-    if (!(filp->f_flags & O_APPEND)) {
-        printk("arco-fs: cover write mode\n");
-        int tmp_mode = raw_inode->i_mode;
-        arcofs_free_file(inode, raw_inode, 1);
-        raw_inode->i_mode = tmp_mode;
-    }
+        // 如果未分配块
+        if (phys == 0) {
+            phys = arcofs_alloc_block(inode);
+            if (phys == 0) {
+                printk("arco-fs: find block err\n");
+                err = -ENOSPC;
+                break;
+            }
+            printk("arco-fs: i_block[%d] alloc block[%d]\n", iblock, phys);
+            raw_inode->i_block[iblock] = phys;
+            inode->i_blocks += ARCOFS_BLOCK_SIZE >> 9;
+            fresh = 1;
+        }
 
-    // 逐个块写入
-    for(r = 0; remain_len > 0; r++) {
-        write_len = remain_len >= 1024 ? 1024 : remain_len;
-        printk("arco-fs: write round %d write_len=%d\n", r, write_len);
-        if (raw_inode->i_size + write_len > 8 * 1024) {
-            printk("arco-fs: exceed file max length, exit\n");
-            return -ENOSPC;
+        // 新分配的块不需要从设备读出旧内容, 清零即可
+        if (fresh) {
+            bhx = sb_getblk(sb, phys);
+            if (bhx) {
+                lock_buffer(bhx);
+                memset(bhx->b_data, 0, ARCOFS_BLOCK_SIZE);
+                set_buffer_uptodate(bhx);
+                unlock_buffer(bhx);
+            }
         }
-        
-        // 如果未分配块
-        if (raw_inode->i_size == 0) {
-            alloc_block = arcofs_alloc_block(inode);
-            raw_inode->i_block[0] = alloc_block;
-            printk("arco-fs: alloc block[%d]\n", alloc_block);
-
-        }
-        // 如果某个块刚好用完(需要更新文件长度
-        else if (raw_inode->i_size % ARCOFS_BLOCK_SIZE == 0) {
-            for (i = 0; i < 8; i++) {
-                if (raw_inode->i_block[i] == 0) {
-                    printk("arco-fs: use i_block[%d]\n", i);
-                    alloc_block = arcofs_alloc_block(inode);
-                    raw_inode->i_block[i] = alloc_block;
-                    break;
-                }
+        else if (arcofs_block_shared(sb->s_fs_info, phys)) {
+            // 和别的文件共享的块不能原地改
+            bhx = arcofs_cow_block(inode, raw_inode, iblock);
+            if (IS_ERR(bhx)) {
+                err = PTR_ERR(bhx);
+                break;
             }
         }
         else {
-            alloc_block = raw_inode->i_block[raw_inode->i_size / 1024];
-            block_offset = raw_inode->i_size % 1024;
-            // 如果最后一个block剩余的空间不足以满足当次的写入
-            printk("arco-fs: block_offset(%d) + write_len(%d) = %d\n", block_offset, write_len, block_offset + write_len);
-            if (block_offset + write_len > 1024) write_len = (1024 - block_offset);
+            bhx = sb_bread(sb, phys);
+        }
+        if (!bhx) {
+            err = -EIO;
+            break;
         }
-        remain_len -= write_len;
 
-    // write_block:
-        if (alloc_block == 0) {
-            printk("arco-fs: find block err\n");
-            return -ENOSPC;
+        if (copy_from_user(bhx->b_data + offset, buf + done, chunk)) {
+            brelse(bhx);
+            err = -EFAULT;
+            break;
         }
-        bhx = sb_bread(sb, alloc_block);
-        memcpy(bhx->b_data + block_offset, kbuf + write_offset, write_len);
-        // 更新inode
-        inode->i_size += write_len;
-        printk("arco-fs: round %d raw_inode->i_size=%d write_len=%d remain_len=%d\n", r, raw_inode->i_size, write_len, remain_len);
-        raw_inode->i_size += write_len;
-        // 标志位处理
-        write_offset += write_len;
-        block_offset = 0;
-        // 标记dirty
-        mark_buffer_dirty(bh);
         mark_buffer_dirty(bhx);
+        brelse(bhx);
+
+        done += chunk;
+        pos += chunk;
     }
 
-    return len;
-}
+update:
+    // 更新inode
+    if (pos > raw_inode->i_size) {
+        raw_inode->i_size = pos;
+        i_size_write(inode, pos);
+    }
+    printk("arco-fs: raw_inode->i_size=%d write_len=%ld\n", raw_inode->i_size, done);
+    mark_buffer_dirty(bh);
+    if (done) {
+        *ppos = pos;
+        inode->i_mtime = inode_set_ctime_current(inode);
+        mark_inode_dirty(inode);
+    }
 
+out:
+    brelse(bh);
+    inode_unlock(inode);
+    return done ? done : err;
+}
 
+static loff_t arcofs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+    int iblock;
+    loff_t size, ret;
+    struct inode *inode = file_inode(file);
+    struct buffer_head *bh;
+    struct arcofs_inode *raw_inode;
 
-// ##4.3 file方法实现
-// 暂无
+    if (whence != SEEK_DATA && whence != SEEK_HOLE)
+        return generic_file_llseek(file, offset, whence);
 
-// ##4.4 super block方法实现
-static int arcofs_statfs(struct dentry *dentry, struct kstatfs *buf)
-{
-	struct super_block *sb = dentry->d_sb;
-	struct arcofs_sb_info *sbi = sb->s_fs_info;
+    raw_inode = arcofs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+    if (!raw_inode)
+        return -EIO;
+
+    inode_lock_shared(inode);
+    size = raw_inode->i_size;
+    if (offset < 0 || offset >= size) {
+        ret = -ENXIO;
+        goto out;
+    }
 
-	buf->f_type = sb->s_magic;
-	buf->f_bsize = sb->s_blocksize;
-	buf->f_blocks = sbi->s_as->s_blocks_count;
-	buf->f_bfree = sbi->s_as->s_free_blocks_count;
-	buf->f_bavail = buf->f_bfree;
-	buf->f_files = (sbi->s_as->s_inodes_count - sbi->s_as->s_free_inodes_count);
-	buf->f_ffree = sbi->s_as->s_free_inodes_count;
+    // 按块粒度查找, 没分配的i_block就是空洞; EOF处视为一个隐式空洞
+    for (iblock = offset / ARCOFS_BLOCK_SIZE; (loff_t)iblock * ARCOFS_BLOCK_SIZE < size; iblock++) {
+        if (arcofs_block_mapped(raw_inode, iblock) == (whence == SEEK_DATA))
+            break;
+    }
+    ret = max_t(loff_t, offset, (loff_t)iblock * ARCOFS_BLOCK_SIZE);
+    if (ret >= size) {
+        if (whence == SEEK_DATA) {
+            ret = -ENXIO;
+            goto out;
+        }
+        ret = size;
+    }
+    ret = vfs_setpos(file, ret, inode->i_sb->s_maxbytes);
 
-	return 0;
+out:
+    inode_unlock_shared(inode);
+    brelse(bh);
+    return ret;
 }
 
 
-/*
- * #5
- * 文件系统挂载函数实现
- * fill_super相关
- */
-struct arcofs_inode* arcofs_raw_inode(struct super_block *sb, int ino, struct buffer_head **bh)
-{
-    int block;
 
-    ino -= 1;
-    block = 4; // inode表所在的块号
+// ##4.3 file方法实现
+// i_blocks只统计真正分配了的块(512字节为单位), 空洞不占空间
+static blkcnt_t arcofs_count_blocks(struct arcofs_inode *raw_inode)
+{
+    int i;
+    blkcnt_t blocks = 0;
 
-    *bh = sb_bread(sb, block);
-    if (!*bh) {
-        printk("arco-fs: Unable to read inode block\n");
-        return NULL;
+    for (i = 0; i < ARCOFS_N_BLOCKS; i++) {
+        if (raw_inode->i_block[i])
+            blocks += ARCOFS_BLOCK_SIZE >> 9;
     }
-
-    return (struct arcofs_inode*)((*bh)->b_data + (ino * sizeof(struct arcofs_inode))); // 加块内偏移地址
+    return blocks;
 }
 
-struct inode *arcofs_iget(struct super_block *sb, unsigned long ino)
+// 把文件截断/扩展到newsize, 调用者持有inode_lock
+// 缩小: newsize之后的整块一批释放, 最后一个不完整的块把newsize之后的部分清零
+// 扩大: 只改i_size, 新增的部分是空洞
+static int arcofs_truncate(struct inode *inode, loff_t newsize)
 {
-    struct inode *inode;
-    struct buffer_head *bh;
+    int iblock, offset, err = 0;
+    struct super_block *sb = inode->i_sb;
+    struct buffer_head *bh, *bhx;
     struct arcofs_inode *raw_inode;
 
-    inode = iget_locked(sb, ino);
-    if (!inode) {
-        printk("arco-fs: iget_locked failed\n");
-        return ERR_PTR(-ENOMEM);
+    printk("arco-fs: truncate inode %lu to %lld\n", inode->i_ino, newsize);
+    raw_inode = arcofs_raw_inode(sb, inode->i_ino, &bh);
+    if (!raw_inode)
+        return -EIO;
+
+    if (newsize < raw_inode->i_size && arcofs_is_compressed(raw_inode)) {
+        err = arcofs_compr_truncate(inode, raw_inode, newsize);
+        if (err)
+            goto out;
     }
-    // 获取原始arcofs inode
-    raw_inode = arcofs_raw_inode(inode->i_sb, inode->i_ino, &bh);
-    // 拼装VFS inode
-    inode->i_size = raw_inode->i_size; // i_size是文件大小
-    inode->i_mode = raw_inode->i_mode; // i_mode是文件类型
+    else if (newsize < raw_inode->i_size) {
+        iblock = newsize / ARCOFS_BLOCK_SIZE;
+        offset = newsize % ARCOFS_BLOCK_SIZE;
+
+        // 尾块里newsize之后的旧数据要清零, 以后再扩展文件时读出来才是0
+        if (offset && raw_inode->i_block[iblock]) {
+            if (arcofs_block_shared(sb->s_fs_info, raw_inode->i_block[iblock]))
+                bhx = arcofs_cow_block(inode, raw_inode, iblock);
+            else
+                bhx = sb_bread(sb, raw_inode->i_block[iblock]);
+            if (IS_ERR_OR_NULL(bhx)) {
+                err = bhx ? PTR_ERR(bhx) : -EIO;
+                goto out;
+            }
+            memset(bhx->b_data + offset, 0, ARCOFS_BLOCK_SIZE - offset);
+            mark_buffer_dirty(bhx);
+            brelse(bhx);
+        }
 
-    arcofs_set_inode(inode, 0);
+        arcofs_free_blocks(sb, raw_inode, DIV_ROUND_UP(newsize, ARCOFS_BLOCK_SIZE), ARCOFS_N_BLOCKS);
+    }
 
-    return inode;
-}
+    raw_inode->i_size = newsize;
+    mark_buffer_dirty(bh);
+    truncate_setsize(inode, newsize);
+    inode->i_blocks = arcofs_count_blocks(raw_inode);
+    inode->i_mtime = inode_set_ctime_current(inode);
 
+out:
+    brelse(bh);
+    return err;
+}
+
+static int arcofs_setattr(struct mnt_idmap *idmap, struct dentry *dentry, struct iattr *attr)
+{
+    int error;
+    struct inode *inode = d_inode(dentry);
+
+    error = setattr_prepare(idmap, dentry, attr);
+    if (error)
+        return error;
+
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        error = arcofs_truncate(inode, attr->ia_size);
+        if (error)
+            return error;
+    }
+
+    setattr_copy(idmap, inode, attr);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+static int arcofs_getattr(struct mnt_idmap *idmap, const struct path *path, struct kstat *stat, u32 request_mask, unsigned int query_flags)
+{
+    struct inode *inode = d_inode(path->dentry);
+    struct buffer_head *bh;
+    struct arcofs_inode *raw_inode;
+
+    generic_fillattr(idmap, request_mask, inode, stat);
+    stat->blksize = ARCOFS_BLOCK_SIZE;
+
+    // st_blocks按磁盘上实际分配的块算, 稀疏文件会小于st_size
+    if (S_ISREG(inode->i_mode)) {
+        raw_inode = arcofs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+        if (raw_inode) {
+            stat->blocks = arcofs_count_blocks(raw_inode);
+            brelse(bh);
+        }
+    }
+    return 0;
+}
+
+static long arcofs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    int ret;
+    struct super_block *sb = file_inode(filp)->i_sb;
+    struct fstrim_range range;
+
+    switch (cmd) {
+    case FITRIM:
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (!bdev_max_discard_sectors(sb->s_bdev))
+            return -EOPNOTSUPP;
+        if (copy_from_user(&range, (struct fstrim_range __user *)arg, sizeof(range)))
+            return -EFAULT;
+
+        range.minlen = max_t(u64, range.minlen, bdev_discard_granularity(sb->s_bdev));
+        ret = arcofs_trim_fs(sb, &range);
+        if (ret < 0)
+            return ret;
+
+        if (copy_to_user((struct fstrim_range __user *)arg, &range, sizeof(range)))
+            return -EFAULT;
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+// chattr +c / -c: 切换文件是否压缩存放
+static int arcofs_fileattr_get(struct dentry *dentry, struct fileattr *fa)
+{
+    struct inode *inode = d_inode(dentry);
+    struct buffer_head *bh;
+    struct arcofs_inode *raw_inode;
+
+    raw_inode = arcofs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+    if (!raw_inode)
+        return -EIO;
+
+    fileattr_fill_flags(fa, arcofs_is_compressed(raw_inode) ? FS_COMPR_FL : 0);
+    brelse(bh);
+    return 0;
+}
+
+static int arcofs_fileattr_set(struct mnt_idmap *idmap, struct dentry *dentry, struct fileattr *fa)
+{
+    int err = 0;
+    struct inode *inode = d_inode(dentry);
+    struct buffer_head *bh;
+    struct arcofs_inode *raw_inode;
+
+    if (fileattr_has_fsx(fa) || (fa->flags & ~FS_COMPR_FL))
+        return -EOPNOTSUPP;
+
+    raw_inode = arcofs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+    if (!raw_inode)
+        return -EIO;
+
+    if (!!(fa->flags & FS_COMPR_FL) == !!arcofs_is_compressed(raw_inode))
+        goto out;
+
+    // 数据块的布局不同, 已经有数据的文件不做转换, 只有空文件可以切换
+    if (arcofs_count_blocks(raw_inode)) {
+        err = -EBUSY;
+        goto out;
+    }
+
+    raw_inode->i_flags ^= ARCOFS_COMPR_FL;
+    mark_buffer_dirty(bh);
+    inode_set_ctime_current(inode);
+    mark_inode_dirty(inode);
+
+out:
+    brelse(bh);
+    return err;
+}
+
+// FICLONE / FICLONERANGE / copy_file_range: 目标文件直接引用源文件的数据块, 写的时候再复制
+static loff_t arcofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags)
+{
+    int n, unit, first_in, first_out;
+    int blocks[ARCOFS_N_BLOCKS];
+    loff_t ret;
+    struct inode *src = file_inode(file_in);
+    struct inode *dst = file_inode(file_out);
+    struct super_block *sb = dst->i_sb;
+    struct buffer_head *bh_in, *bh_out;
+    struct arcofs_inode *raw_in, *raw_out;
+
+    if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_CAN_SHORTEN | REMAP_FILE_ADVISORY))
+        return -EINVAL;
+    // 去重要逐块比较内容, 先不支持
+    if (remap_flags & REMAP_FILE_DEDUP)
+        return -EOPNOTSUPP;
+
+    lock_two_nondirectories(src, dst);
+    ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out, &len, remap_flags);
+    if (ret < 0 || len == 0)
+        goto out_unlock;
+
+    ret = -EIO;
+    raw_in = arcofs_raw_inode(sb, src->i_ino, &bh_in);
+    if (!raw_in)
+        goto out_unlock;
+    raw_out = arcofs_raw_inode(sb, dst->i_ino, &bh_out);
+    if (!raw_out)
+        goto out_brelse_in;
+
+    // 压缩文件按cluster共享, 两边的存放方式必须一样, 偏移也要对齐到cluster
+    unit = ARCOFS_BLOCK_SIZE;
+    if (arcofs_is_compressed(raw_in) != arcofs_is_compressed(raw_out)) {
+        ret = -EINVAL;
+        goto out_brelse;
+    }
+    if (arcofs_is_compressed(raw_in)) {
+        unit = ARCOFS_CLUSTER_SIZE;
+        if (!IS_ALIGNED(pos_in, unit) || !IS_ALIGNED(pos_out, unit) ||
+            (!IS_ALIGNED(len, unit) && pos_in + len != i_size_read(src))) {
+            ret = -EINVAL;
+            goto out_brelse;
+        }
+    }
+    // 源文件末尾不完整的块也整块共享, 所以不能落在目标文件中间, 否则会盖掉目标后面的数据
+    if (!IS_ALIGNED(len, unit) && pos_out + len < i_size_read(dst)) {
+        ret = -EINVAL;
+        goto out_brelse;
+    }
+
+    first_in = pos_in / ARCOFS_BLOCK_SIZE;
+    first_out = pos_out / ARCOFS_BLOCK_SIZE;
+    n = DIV_ROUND_UP(len, unit) * (unit / ARCOFS_BLOCK_SIZE);
+    if (first_in + n > ARCOFS_N_BLOCKS || first_out + n > ARCOFS_N_BLOCKS) {
+        ret = -EFBIG;
+        goto out_brelse;
+    }
+
+    // 先拷一份源映射再加引用, 同一个文件内部clone时源和目标是同一个i_block
+    memcpy(blocks, &raw_in->i_block[first_in], n * sizeof(int));
+    ret = arcofs_share_block_list(sb, blocks, n);
+    if (ret)
+        goto out_brelse;
+
+    // 目标的page cache还对着旧块
+    truncate_inode_pages_range(&dst->i_data, pos_out, round_up(pos_out + len, ARCOFS_BLOCK_SIZE) - 1);
+    arcofs_free_blocks(sb, raw_out, first_out, first_out + n);
+    memcpy(&raw_out->i_block[first_out], blocks, n * sizeof(int));
+    printk("arco-fs: clone inode %lu block %d~%d to inode %lu block %d\n",
+           src->i_ino, first_in, first_in + n, dst->i_ino, first_out);
+
+    if (pos_out + len > raw_out->i_size) {
+        raw_out->i_size = pos_out + len;
+        i_size_write(dst, pos_out + len);
+    }
+    mark_buffer_dirty(bh_out);
+    dst->i_blocks = arcofs_count_blocks(raw_out);
+    dst->i_mtime = inode_set_ctime_current(dst);
+    mark_inode_dirty(dst);
+    ret = len;
+
+out_brelse:
+    brelse(bh_out);
+out_brelse_in:
+    brelse(bh_in);
+out_unlock:
+    unlock_two_nondirectories(src, dst);
+    return ret;
+}
+
+// ##4.4 super block方法实现
+static void arcofs_evict_inode(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+    unsigned long ino = inode->i_ino;
+    int unlinked = !inode->i_nlink && !is_bad_inode(inode);
+    int big = inode->i_blocks >= ARCOFS_ASYNC_RECLAIM_BLOCKS * (ARCOFS_BLOCK_SIZE >> 9);
+
+    truncate_inode_pages_final(&inode->i_data);
+    invalidate_inode_buffers(inode);
+    clear_inode(inode);
+
+    if (!unlinked)
+        return;
+
+    // 小文件直接释放; 大文件交给后台, 调用unlink/close的线程不用等
+    if (big) {
+        set_bit(ino - 1, sbi->s_reclaim_pending);
+        queue_work(system_unbound_wq, &sbi->s_reclaim_work);
+    }
+    else {
+        arcofs_reclaim_inode(sb, ino);
+    }
+}
+
+// 释放sbi以及它一直持有的buffer, put_super和fill_super失败时共用
+static void arcofs_free_sbi(struct arcofs_sb_info *sbi)
+{
+    int g;
+
+    if (sbi->s_groups) {
+        for (g = 0; g < sbi->s_groups_count; g++)
+            brelse(sbi->s_groups[g].g_bh);
+        kfree(sbi->s_groups);
+    }
+    brelse(sbi->s_imap_bh);
+    brelse(sbi->s_sbh);
+    percpu_counter_destroy(&sbi->s_freeblocks_counter);
+    percpu_counter_destroy(&sbi->s_freeinodes_counter);
+    bitmap_free(sbi->s_discard_busy);
+    kvfree(sbi->s_lz4_wmem);
+    kfree(sbi->s_cbuf);
+    kfree(sbi);
+}
+
+// 卷变成可写时调用: 记为dirty并立刻落盘, 掉电后下次挂载会重建计数
+static void arcofs_mark_dirty(struct super_block *sb)
+{
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+
+    sbi->s_as->s_state &= ~ARCOFS_STATE_CLEAN;
+    mark_buffer_dirty(sbi->s_sbh);
+    sync_dirty_buffer(sbi->s_sbh);
+}
+
+// 卷不再写入时调用(卸载或者remount只读): 等后台释放和discard做完,
+// bytemap和inode表都落盘以后才能记clean, 下次挂载直接用super block里的计数
+static void arcofs_mark_clean(struct super_block *sb)
+{
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+
+    // 后台释放会产生新的discard, 所以先等它做完
+    flush_work(&sbi->s_reclaim_work);
+    if (sbi->s_mount_opt & ARCOFS_MOUNT_DISCARD)
+        flush_delayed_work(&sbi->s_discard_work);
+
+    sync_blockdev(sb->s_bdev);
+    sbi->s_as->s_state |= ARCOFS_STATE_CLEAN;
+    arcofs_sync_fs(sb, 1);
+}
+
+static void arcofs_put_super(struct super_block *sb)
+{
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+
+    if (!sb_rdonly(sb))
+        arcofs_mark_clean(sb);
+
+    arcofs_free_sbi(sbi);
+    sb->s_fs_info = NULL;
+}
+
+// 只处理ro/rw切换, 其他挂载选项remount时不变
+static int arcofs_remount(struct super_block *sb, int *flags, char *data)
+{
+    sync_filesystem(sb);
+    if (!!(*flags & SB_RDONLY) == !!sb_rdonly(sb))
+        return 0;
+
+    if (*flags & SB_RDONLY) {
+        printk("arco-fs: remount read-only\n");
+        arcofs_mark_clean(sb);
+    }
+    else {
+        // 只读挂载时没回收orphan, 可写了先记dirty再回收
+        printk("arco-fs: remount read-write\n");
+        arcofs_mark_dirty(sb);
+        arcofs_orphan_cleanup(sb);
+    }
+    return 0;
+}
+
+static int arcofs_show_options(struct seq_file *seq, struct dentry *root)
+{
+    struct arcofs_sb_info *sbi = root->d_sb->s_fs_info;
+
+    if (sbi->s_mount_opt & ARCOFS_MOUNT_DISCARD)
+        seq_puts(seq, ",discard");
+    if (sbi->s_mount_opt & ARCOFS_MOUNT_COMPRESS)
+        seq_puts(seq, ",compress");
+    return 0;
+}
+
+static int arcofs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct arcofs_sb_info *sbi = sb->s_fs_info;
+
+	buf->f_type = sb->s_magic;
+	buf->f_bsize = sb->s_blocksize;
+	// 组1以后每个组的第一块是bytemap, 不能分配给文件, 不算进总块数
+	buf->f_blocks = sbi->s_as->s_blocks_count - (sbi->s_groups_count - 1);
+	buf->f_bfree = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = sbi->s_as->s_inodes_count;
+	buf->f_ffree = percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+
+	return 0;
+}
+
+// 把per-CPU计数器汇总回磁盘上的super block
+static int arcofs_sync_fs(struct super_block *sb, int wait)
+{
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+
+    sbi->s_as->s_free_blocks_count = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+    sbi->s_as->s_free_inodes_count = percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+    mark_buffer_dirty(sbi->s_sbh);
+    if (wait)
+        sync_dirty_buffer(sbi->s_sbh);
+    return 0;
+}
+
+// ##4.5 discard/trim实现
+// s_discard_busy由各组的g_lock分别保护, blocks_per_group不一定是BITS_PER_LONG的整数倍,
+// 两个组的位可能落在同一个word里, 所以不能用bitmap_set/bitmap_clear这种整word读改写
+static void arcofs_discard_busy_set(struct arcofs_sb_info *sbi, int start, int len)
+{
+    int i;
+
+    for (i = start; i < start + len; i++)
+        set_bit(i, sbi->s_discard_busy);
+}
+
+static void arcofs_discard_busy_clear(struct arcofs_sb_info *sbi, int start, int len)
+{
+    int i;
+
+    for (i = start; i < start + len; i++)
+        clear_bit(i, sbi->s_discard_busy);
+}
+
+// 把刚释放的块挂到待discard链表上, 调用者持有块所在组的g_lock
+static void arcofs_discard_queue(struct super_block *sb, int block)
+{
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+    struct arcofs_discard_extent *ex;
+
+    spin_lock(&sbi->s_discard_lock);
+    // 同一个文件的块通常是连着分配的, 先尝试接到最后一个extent上
+    if (!list_empty(&sbi->s_discard_list)) {
+        ex = list_last_entry(&sbi->s_discard_list, struct arcofs_discard_extent, list);
+        if (ex->start + ex->len == block) {
+            ex->len++;
+            goto out;
+        }
+        if (block + 1 == ex->start) {
+            ex->start--;
+            ex->len++;
+            goto out;
+        }
+    }
+
+    // 内存不够就放弃这一块的discard, 不影响正确性
+    ex = kmalloc(sizeof(*ex), GFP_ATOMIC);
+    if (!ex)
+        goto unlock;
+    ex->start = block;
+    ex->len = 1;
+    list_add_tail(&ex->list, &sbi->s_discard_list);
+
+out:
+    set_bit(block, sbi->s_discard_busy);
+unlock:
+    spin_unlock(&sbi->s_discard_lock);
+}
+
+static int arcofs_discard_cmp(void *priv, const struct list_head *a, const struct list_head *b)
+{
+    return list_entry(a, struct arcofs_discard_extent, list)->start -
+           list_entry(b, struct arcofs_discard_extent, list)->start;
+}
+
+static void arcofs_discard_work(struct work_struct *work)
+{
+    struct arcofs_sb_info *sbi = container_of(to_delayed_work(work), struct arcofs_sb_info, s_discard_work);
+    struct super_block *sb = sbi->s_sb;
+    struct arcofs_discard_extent *ex, *next;
+    LIST_HEAD(pending);
+
+    spin_lock(&sbi->s_discard_lock);
+    list_splice_init(&sbi->s_discard_list, &pending);
+    spin_unlock(&sbi->s_discard_lock);
+    if (list_empty(&pending))
+        return;
+
+    // 按起始块排序, 相邻的extent合并成一个, 尽量少发discard请求
+    list_sort(NULL, &pending, arcofs_discard_cmp);
+    list_for_each_entry_safe(ex, next, &pending, list) {
+        if (&next->list != &pending && ex->start + ex->len == next->start) {
+            next->start = ex->start;
+            next->len += ex->len;
+            list_del(&ex->list);
+            kfree(ex);
+        }
+    }
+
+    // 释放是一整套修改: bytemap、inode表里清掉的i_block/i_mode、super block上的orphan链表
+    // 这些都落盘以后才能discard, 否则掉电后磁盘上的inode还指着已经被discard(甚至重新分配)的块
+    sync_blockdev(sb->s_bdev);
+
+    list_for_each_entry_safe(ex, next, &pending, list) {
+        printk("arco-fs: discard block %d len %d\n", ex->start, ex->len);
+        sb_issue_discard(sb, ex->start, ex->len, GFP_NOFS, 0);
+
+        arcofs_discard_busy_clear(sbi, ex->start, ex->len);
+
+        list_del(&ex->list);
+        kfree(ex);
+    }
+}
+
+// FITRIM: 逐组扫描block bytemap, 把[start, start+len)内的空闲块成段discard
+static int arcofs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+    int g, ret = 0;
+    u64 i, run, start, end, gend, minlen, trimmed = 0;
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+    struct arcofs_group_info *grp;
+
+    if (range->len < ARCOFS_BLOCK_SIZE)
+        return -EINVAL;
+
+    start = range->start / ARCOFS_BLOCK_SIZE;
+    end = min_t(u64, start + range->len / ARCOFS_BLOCK_SIZE, sbi->s_total_blocks);
+    minlen = max_t(u64, DIV_ROUND_UP(range->minlen, ARCOFS_BLOCK_SIZE), 1);
+
+    for (g = 0; g < sbi->s_groups_count && !ret; g++) {
+        grp = &sbi->s_groups[g];
+        i = max_t(u64, start, arcofs_group_first_data(sbi, g));
+        gend = min_t(u64, end, arcofs_group_end(sbi, g));
+        if (i >= gend)
+            continue;
+        ret = arcofs_load_group(sbi, g);
+        if (ret)
+            break;
+
+        while (i < gend) {
+            // 在锁里找出一段连续空闲块并标记busy, 出锁以后再发discard, 期间不会被分配出去
+            spin_lock(&grp->g_lock);
+            while (i < gend && (*arcofs_group_entry(sbi, i) != 1 || test_bit(i, sbi->s_discard_busy)))
+                i++;
+            for (run = 0; i + run < gend; run++) {
+                if (*arcofs_group_entry(sbi, i + run) != 1 || test_bit(i + run, sbi->s_discard_busy))
+                    break;
+            }
+            if (run >= minlen)
+                arcofs_discard_busy_set(sbi, i, run);
+            spin_unlock(&grp->g_lock);
+
+            if (run == 0)
+                break;
+
+            if (run >= minlen) {
+                ret = sb_issue_discard(sb, i, run, GFP_NOFS, 0);
+                arcofs_discard_busy_clear(sbi, i, run);
+                if (ret)
+                    break;
+                trimmed += run;
+            }
+            i += run;
+
+            if (fatal_signal_pending(current)) {
+                ret = -ERESTARTSYS;
+                break;
+            }
+            cond_resched();
+        }
+    }
+
+    printk("arco-fs: fitrim trimmed %llu blocks\n", trimmed);
+    range->len = trimmed * ARCOFS_BLOCK_SIZE;
+    return ret;
+}
+
+
+// ##4.6 透明压缩实现
+// 读出第c个cluster解压后的内容, buf至少ARCOFS_CLUSTER_SIZE字节, 空洞填0
+static int arcofs_cluster_read(struct super_block *sb, struct arcofs_inode *raw_inode, int c, char *buf)
+{
+    int i, nr, ret = 0;
+    int *slot = &raw_inode->i_block[c * ARCOFS_CLUSTER_BLOCKS];
+    char *cbuf;
+    struct buffer_head *bh;
+    struct arcofs_cluster_head *head;
+
+    for (nr = 0; nr < ARCOFS_CLUSTER_BLOCKS && slot[nr]; nr++)
+        ;
+    if (nr == 0) {
+        memset(buf, 0, ARCOFS_CLUSTER_SIZE);
+        return 0;
+    }
+
+    // 没压缩的cluster直接读到buf里, 压缩的先读到临时缓冲再解压
+    cbuf = (nr == ARCOFS_CLUSTER_BLOCKS) ? buf : kmalloc(nr * ARCOFS_BLOCK_SIZE, GFP_NOFS);
+    if (!cbuf)
+        return -ENOMEM;
+    for (i = 0; i < nr; i++) {
+        bh = sb_bread(sb, slot[i]);
+        if (!bh) {
+            ret = -EIO;
+            goto out;
+        }
+        memcpy(cbuf + i * ARCOFS_BLOCK_SIZE, bh->b_data, ARCOFS_BLOCK_SIZE);
+        brelse(bh);
+    }
+    if (cbuf == buf)
+        return 0;
+
+    head = (struct arcofs_cluster_head *)cbuf;
+    if (head->c_magic != ARCOFS_CLUSTER_MAGIC || head->c_size <= 0 ||
+        head->c_size > nr * ARCOFS_BLOCK_SIZE - sizeof(*head)) {
+        printk("arco-fs: bad compressed cluster %d\n", c);
+        ret = -EIO;
+        goto out;
+    }
+    ret = LZ4_decompress_safe(cbuf + sizeof(*head), buf, head->c_size, ARCOFS_CLUSTER_SIZE);
+    if (ret < 0) {
+        printk("arco-fs: decompress cluster %d failed\n", c);
+        ret = -EIO;
+        goto out;
+    }
+    memset(buf + ret, 0, ARCOFS_CLUSTER_SIZE - ret);
+    ret = 0;
+
+out:
+    if (cbuf != buf)
+        kfree(cbuf);
+    return ret;
+}
+
+// 把buf里第c个cluster的前len字节压缩后写回, buf必须有ARCOFS_CLUSTER_SIZE字节
+// 先分配新块写好数据再释放旧块, 中途失败时旧数据还在
+static int arcofs_cluster_write(struct inode *inode, struct arcofs_inode *raw_inode, int c, char *buf, int len)
+{
+    int i, n, nr = 0, avail, clen, ret = 0;
+    int first = c * ARCOFS_CLUSTER_BLOCKS;
+    int blocks[ARCOFS_CLUSTER_BLOCKS] = {0};
+    const char *src;
+    struct super_block *sb = inode->i_sb;
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+    struct arcofs_cluster_head *head;
+    struct buffer_head *bh;
+
+    // 全是0的cluster不占块, 保持空洞
+    if (len <= 0 || !memchr_inv(buf, 0, len))
+        goto replace;
+
+    mutex_lock(&sbi->s_compress_lock);
+    head = (struct arcofs_cluster_head *)sbi->s_cbuf;
+    clen = LZ4_compress_default(buf, sbi->s_cbuf + sizeof(*head), len,
+                                (ARCOFS_CLUSTER_BLOCKS - 1) * ARCOFS_BLOCK_SIZE - sizeof(*head),
+                                sbi->s_lz4_wmem);
+    if (clen > 0) {
+        // 压缩后至少省下一个块
+        head->c_magic = ARCOFS_CLUSTER_MAGIC;
+        head->c_size = clen;
+        avail = sizeof(*head) + clen;
+        src = sbi->s_cbuf;
+    }
+    else {
+        // 压不下来就原样存满4块, 读的时候靠块数区分
+        memset(buf + len, 0, ARCOFS_CLUSTER_SIZE - len);
+        avail = ARCOFS_CLUSTER_SIZE;
+        src = buf;
+    }
+    nr = DIV_ROUND_UP(avail, ARCOFS_BLOCK_SIZE);
+    printk("arco-fs: cluster %d len %d stored in %d blocks\n", c, len, nr);
+
+    for (i = 0; i < nr; i++) {
+        blocks[i] = arcofs_alloc_block(inode);
+        if (!blocks[i]) {
+            ret = -ENOSPC;
+            break;
+        }
+        bh = sb_getblk(sb, blocks[i]);
+        if (!bh) {
+            ret = -EIO;
+            break;
+        }
+        n = min_t(int, ARCOFS_BLOCK_SIZE, avail - i * ARCOFS_BLOCK_SIZE);
+        lock_buffer(bh);
+        memcpy(bh->b_data, src + i * ARCOFS_BLOCK_SIZE, n);
+        memset(bh->b_data + n, 0, ARCOFS_BLOCK_SIZE - n);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+        brelse(bh);
+    }
+    mutex_unlock(&sbi->s_compress_lock);
+
+    if (ret) {
+        arcofs_free_block_list(sb, blocks, ARCOFS_CLUSTER_BLOCKS);
+        return ret;
+    }
+
+replace:
+    arcofs_free_blocks(sb, raw_inode, first, first + ARCOFS_CLUSTER_BLOCKS);
+    memcpy(&raw_inode->i_block[first], blocks, sizeof(blocks));
+    inode->i_blocks = arcofs_count_blocks(raw_inode);
+    return 0;
+}
+
+static ssize_t arcofs_compr_read(struct super_block *sb, struct arcofs_inode *raw_inode, char __user *buf, size_t len, loff_t pos)
+{
+    int c, offset, chunk, err = 0;
+    size_t done = 0;
+    char *cbuf;
+
+    cbuf = kmalloc(ARCOFS_CLUSTER_SIZE, GFP_NOFS);
+    if (!cbuf)
+        return -ENOMEM;
+
+    // 每次解压一个cluster, 把需要的部分拷给用户态
+    while (done < len) {
+        c = pos / ARCOFS_CLUSTER_SIZE;
+        offset = pos % ARCOFS_CLUSTER_SIZE;
+        chunk = min_t(size_t, ARCOFS_CLUSTER_SIZE - offset, len - done);
+
+        err = arcofs_cluster_read(sb, raw_inode, c, cbuf);
+        if (err)
+            break;
+        if (copy_to_user(buf + done, cbuf + offset, chunk)) {
+            err = -EFAULT;
+            break;
+        }
+        done += chunk;
+        pos += chunk;
+    }
+
+    kfree(cbuf);
+    return done ? done : err;
+}
+
+static ssize_t arcofs_compr_write(struct inode *inode, struct arcofs_inode *raw_inode, const char __user *buf, size_t len, loff_t pos)
+{
+    int c, offset, chunk, valid, err = 0;
+    size_t done = 0;
+    char *cbuf;
+
+    cbuf = kmalloc(ARCOFS_CLUSTER_SIZE, GFP_NOFS);
+    if (!cbuf)
+        return -ENOMEM;
+
+    // 按cluster读-改-写, 整个cluster覆盖时不用先解压旧数据
+    while (done < len) {
+        c = pos / ARCOFS_CLUSTER_SIZE;
+        offset = pos % ARCOFS_CLUSTER_SIZE;
+        chunk = min_t(size_t, ARCOFS_CLUSTER_SIZE - offset, len - done);
+
+        if (chunk < ARCOFS_CLUSTER_SIZE) {
+            err = arcofs_cluster_read(inode->i_sb, raw_inode, c, cbuf);
+            if (err)
+                break;
+        }
+        if (copy_from_user(cbuf + offset, buf + done, chunk)) {
+            err = -EFAULT;
+            break;
+        }
+
+        // cluster里有效数据只到文件末尾
+        valid = min_t(loff_t, ARCOFS_CLUSTER_SIZE,
+                      max_t(loff_t, raw_inode->i_size, pos + chunk) - (loff_t)c * ARCOFS_CLUSTER_SIZE);
+        err = arcofs_cluster_write(inode, raw_inode, c, cbuf, valid);
+        if (err)
+            break;
+        done += chunk;
+        pos += chunk;
+    }
+
+    kfree(cbuf);
+    return done ? done : err;
+}
+
+// 压缩文件截断: 最后一个不完整的cluster解压后清掉newsize之后的部分再压回去
+static int arcofs_compr_truncate(struct inode *inode, struct arcofs_inode *raw_inode, loff_t newsize)
+{
+    int c, offset, err = 0;
+    char *cbuf;
+
+    c = newsize / ARCOFS_CLUSTER_SIZE;
+    offset = newsize % ARCOFS_CLUSTER_SIZE;
+    if (offset && raw_inode->i_block[c * ARCOFS_CLUSTER_BLOCKS]) {
+        cbuf = kmalloc(ARCOFS_CLUSTER_SIZE, GFP_NOFS);
+        if (!cbuf)
+            return -ENOMEM;
+        err = arcofs_cluster_read(inode->i_sb, raw_inode, c, cbuf);
+        if (!err)
+            err = arcofs_cluster_write(inode, raw_inode, c, cbuf, offset);
+        kfree(cbuf);
+        if (err)
+            return err;
+    }
+
+    arcofs_free_blocks(inode->i_sb, raw_inode,
+                       DIV_ROUND_UP(newsize, ARCOFS_CLUSTER_SIZE) * ARCOFS_CLUSTER_BLOCKS, ARCOFS_N_BLOCKS);
+    return 0;
+}
+
+
+/*
+ * #5
+ * 文件系统挂载函数实现
+ * fill_super相关
+ */
+enum {
+    Opt_discard, Opt_nodiscard, Opt_compress, Opt_nocompress, Opt_err
+};
+
+static const match_table_t arcofs_tokens = {
+    {Opt_discard, "discard"},
+    {Opt_nodiscard, "nodiscard"},
+    {Opt_compress, "compress"},
+    {Opt_nocompress, "nocompress"},
+    {Opt_err, NULL},
+};
+
+static int arcofs_parse_options(char *options, struct arcofs_sb_info *sbi)
+{
+    char *p;
+    substring_t args[MAX_OPT_ARGS];
+
+    if (!options)
+        return 0;
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+        switch (match_token(p, arcofs_tokens, args)) {
+        case Opt_discard:
+            sbi->s_mount_opt |= ARCOFS_MOUNT_DISCARD;
+            break;
+        case Opt_nodiscard:
+            sbi->s_mount_opt &= ~ARCOFS_MOUNT_DISCARD;
+            break;
+        case Opt_compress:
+            sbi->s_mount_opt |= ARCOFS_MOUNT_COMPRESS;
+            break;
+        case Opt_nocompress:
+            sbi->s_mount_opt &= ~ARCOFS_MOUNT_COMPRESS;
+            break;
+        default:
+            printk("arco-fs: unrecognized mount option \"%s\"\n", p);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+struct arcofs_inode* arcofs_raw_inode(struct super_block *sb, int ino, struct buffer_head **bh)
+{
+    int block;
+
+    ino -= 1;
+    block = 4; // inode表所在的块号
+
+    *bh = sb_bread(sb, block);
+    if (!*bh) {
+        printk("arco-fs: Unable to read inode block\n");
+        return NULL;
+    }
+
+    return (struct arcofs_inode*)((*bh)->b_data + (ino * sizeof(struct arcofs_inode))); // 加块内偏移地址
+}
+
+struct inode *arcofs_iget(struct super_block *sb, unsigned long ino)
+{
+    struct inode *inode;
+    struct buffer_head *bh;
+    struct arcofs_inode *raw_inode;
+
+    inode = iget_locked(sb, ino);
+    if (!inode) {
+        printk("arco-fs: iget_locked failed\n");
+        return ERR_PTR(-ENOMEM);
+    }
+    if (!(inode->i_state & I_NEW))
+        return inode;
+
+    // 获取原始arcofs inode
+    raw_inode = arcofs_raw_inode(inode->i_sb, inode->i_ino, &bh);
+    // 拼装VFS inode
+    inode->i_size = raw_inode->i_size; // i_size是文件大小
+    inode->i_mode = raw_inode->i_mode; // i_mode是文件类型
+    inode->i_blocks = arcofs_count_blocks(raw_inode);
+    brelse(bh);
+
+    arcofs_set_inode(inode, 0);
+    unlock_new_inode(inode);
+
+    return inode;
+}
+
+// 挂载时回收上次没来得及释放的orphan inode(unlink之后掉电)
+static void arcofs_orphan_cleanup(struct super_block *sb)
+{
+    int n = 0;
+    unsigned long ino;
+    struct arcofs_sb_info *sbi = sb->s_fs_info;
+
+    while ((ino = sbi->s_as->s_last_orphan) != 0 && n++ < sbi->s_as->s_inodes_count) {
+        if (ino > sbi->s_as->s_inodes_count) {
+            printk("arco-fs: bad orphan inode %lu, drop orphan list\n", ino);
+            sbi->s_as->s_last_orphan = 0;
+            mark_buffer_dirty(sbi->s_sbh);
+            break;
+        }
+        printk("arco-fs: recover orphan inode %lu\n", ino);
+        arcofs_reclaim_inode(sb, ino);
+    }
+}
+
+// 扫描各组的bytemap和inode bytemap, 算出空闲块/inode数, 初始化per-CPU计数器
+static int arcofs_init_counters(struct arcofs_sb_info *sbi)
+{
+    int g, i, err;
+    s64 free_blocks = 0, free_inodes = 0;
+    unsigned char *inode_bytemap_arr;
+
+    if (sbi->s_as->s_state & ARCOFS_STATE_CLEAN) {
+        // 上次正常卸载, 直接用super block里存的计数, 一个bytemap都不用读
+        free_blocks = sbi->s_as->s_free_blocks_count;
+        free_inodes = sbi->s_as->s_free_inodes_count;
+        printk("arco-fs: clean mount, %d groups, free blocks %lld, free inodes %lld\n",
+               sbi->s_groups_count, free_blocks, free_inodes);
+        goto init;
+    }
+
+    // 上次没正常卸载(或者是老镜像), 计数可能不准, 把bytemap都读进来重新数
+    for (g = 0; g < sbi->s_groups_count; g++) {
+        if (arcofs_load_group(sbi, g))
+            return -EIO;
+        for (i = arcofs_group_first_data(sbi, g); i < arcofs_group_end(sbi, g); i++) {
+            if (*arcofs_group_entry(sbi, i) == 1)
+                free_blocks++;
+        }
+    }
+    if (arcofs_load_imap(sbi))
+        return -EIO;
+    inode_bytemap_arr = (unsigned char*)sbi->s_imap_bh->b_data;
+    for (i = 0; i < sbi->s_as->s_inodes_count; i++) {
+        if (inode_bytemap_arr[i] == 1)
+            free_inodes++;
+    }
+    printk("arco-fs: dirty mount, rebuild counters: %d groups, free blocks %lld, free inodes %lld\n",
+           sbi->s_groups_count, free_blocks, free_inodes);
+
+init:
+    err = percpu_counter_init(&sbi->s_freeblocks_counter, free_blocks, GFP_KERNEL);
+    if (!err)
+        err = percpu_counter_init(&sbi->s_freeinodes_counter, free_inodes, GFP_KERNEL);
+    return err;
+}
 
 static int arcofs_fill_super(struct super_block *s, void *data, int silent)
 {
-    int err = -1;
+    int g, err = -1;
     struct arcofs_sb_info *sbi;
     struct inode *root_inode;
-    struct buffer_head *bh, *bh2, *bh3;
+    struct buffer_head *bh;
     struct arcofs_super_block *as;
 
     sbi = kzalloc(sizeof(struct arcofs_sb_info), GFP_KERNEL);
     if (!sbi)
         return -ENOMEM;
     s->s_fs_info = sbi;
+    sbi->s_sb = s;
+    spin_lock_init(&sbi->s_imap_lock);
+    spin_lock_init(&sbi->s_discard_lock);
+    INIT_LIST_HEAD(&sbi->s_discard_list);
+    INIT_DELAYED_WORK(&sbi->s_discard_work, arcofs_discard_work);
+    mutex_init(&sbi->s_orphan_lock);
+    INIT_WORK(&sbi->s_reclaim_work, arcofs_reclaim_work);
+    mutex_init(&sbi->s_compress_lock);
 
     // 设置sb->s_blocksize
     if (!sb_set_blocksize(s, ARCOFS_BLOCK_SIZE))
         goto out_bad_hblock;
+    s->s_maxbytes = ARCOFS_MAX_FILE_SIZE;
 
     if (!(bh = sb_bread(s, 1)))
         goto out_bad_sb;
 
-    if (!(bh2 = sb_bread(s, 2)))
-        goto out_bad_map;
-
-    if (!(bh3 = sb_bread(s, 3)))
-        goto out_bad_map;
-
     // 把上一步读取出的块作为arcofs super_block
     as = (struct arcofs_super_block*) bh->b_data;
+    sbi->s_sbh = bh;
     sbi->s_as = as;
 
 	s->s_magic = as->s_magic;
 
-    // 判断block是否足够
+    // 格式化时带了-c的卷默认压缩新文件, 挂载选项可以覆盖
+    if (as->s_flags & ARCOFS_SB_COMPRESS)
+        sbi->s_mount_opt |= ARCOFS_MOUNT_COMPRESS;
+    err = arcofs_parse_options(data, sbi);
+    if (err)
+        goto out_free;
+    err = -1;
+
+    if ((sbi->s_mount_opt & ARCOFS_MOUNT_DISCARD) && !bdev_max_discard_sectors(s->s_bdev)) {
+        printk("arco-fs: device does not support discard, ignore discard option\n");
+        sbi->s_mount_opt &= ~ARCOFS_MOUNT_DISCARD;
+    }
+
+    // 划分分配组
+    sbi->s_total_blocks = as->s_blocks_count + ARCOFS_FIRST_DATA_BLOCK;
+    sbi->s_blocks_per_group = as->s_blocks_per_group;
+    if (sbi->s_blocks_per_group == 0) {
+        // 老镜像没有分配组, 整个卷只有第2块这一个bytemap
+        sbi->s_blocks_per_group = ARCOFS_BLOCK_SIZE;
+        sbi->s_total_blocks = min(sbi->s_total_blocks, ARCOFS_BLOCK_SIZE);
+    }
+    if (sbi->s_blocks_per_group <= ARCOFS_FIRST_DATA_BLOCK || sbi->s_blocks_per_group > ARCOFS_BLOCK_SIZE) {
+        printk("arco-fs: bad blocks per group %d\n", sbi->s_blocks_per_group);
+        err = -EINVAL;
+        goto out_free;
+    }
+    sbi->s_groups_count = DIV_ROUND_UP(sbi->s_total_blocks, sbi->s_blocks_per_group);
+
+    err = -ENOMEM;
+    sbi->s_groups = kcalloc(sbi->s_groups_count, sizeof(struct arcofs_group_info), GFP_KERNEL);
+    if (!sbi->s_groups)
+        goto out_free;
+    sbi->s_discard_busy = bitmap_zalloc(sbi->s_total_blocks, GFP_KERNEL);
+    if (!sbi->s_discard_busy)
+        goto out_free;
+    sbi->s_lz4_wmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+    sbi->s_cbuf = kmalloc((ARCOFS_CLUSTER_BLOCKS - 1) * ARCOFS_BLOCK_SIZE, GFP_KERNEL);
+    if (!sbi->s_lz4_wmem || !sbi->s_cbuf)
+        goto out_free;
+    err = -1;
+
+    // 组的bytemap和inode bytemap都等第一次用到时再读
+    for (g = 0; g < sbi->s_groups_count; g++)
+        spin_lock_init(&sbi->s_groups[g].g_lock);
+
+    err = arcofs_init_counters(sbi);
+    if (err == -EIO)
+        goto out_bad_map;
+    if (err)
+        goto out_free;
+    err = -1;
+
+    if (!sb_rdonly(s))
+        arcofs_mark_dirty(s);
 
     // 注册super block操作结构
     s->s_op = &arcofs_sops;
@@ -669,6 +2218,9 @@ static int arcofs_fill_super(struct super_block *s, void *data, int silent)
     if (!s->s_root)
         goto out_no_root;
 
+    if (!sb_rdonly(s))
+        arcofs_orphan_cleanup(s);
+
     printk("arco-fs: fill super seems ok\n");
 
     return 0;
@@ -685,6 +2237,9 @@ static int arcofs_fill_super(struct super_block *s, void *data, int silent)
     out_no_root:
     printk("arco-fs: no root error\n");
 
+    out_free:
+    arcofs_free_sbi(sbi);
+    s->s_fs_info = NULL;
     return err;
 }
 
@@ -0,0 +1,348 @@
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<time.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<dirent.h>
+#include<pthread.h>
+#include<sys/stat.h>
+
+/*
+ * arcofs元数据和并发读写压测
+ * 用法: arcobench [-n 轮数] [-f 文件数] [-t 线程数] [-b 块大小] [-s 文件大小] [-r] <挂载点> <负载>
+ * 负载: create / stat / unlink / readdir / write / read
+ * 结果按一行json打印到stdout, 和run.sh里fio的结果格式一致; 出错信息打到stderr, 退出码非0
+ *
+ * arcofs只有一个目录, inode表只有一个块(16个inode, 去掉.和..剩14个),
+ * 文件最大8kb, 文件名最多11字节, 所以"大目录"就是装满14个文件的根目录,
+ * 元数据风暴是在这14个名字上反复建/查/删
+ */
+
+#define ARCOFS_MAX_FILES 14
+#define ARCOFS_MAX_FILE_SIZE (8 * 1024)
+
+struct bench_opts {
+    const char *dir;
+    const char *workload;
+    int iters;
+    int nfiles;
+    int threads;
+    int bs;
+    int size;
+    int random;
+};
+
+struct bench_thread {
+    pthread_t tid;
+    int idx;
+    struct bench_opts *opts;
+    uint64_t *lat;      // 每次操作的耗时(ns)
+    long nlat;
+    long bytes;
+    uint64_t end;       // 计时循环结束的时间
+    int err;
+};
+
+// io线程准备好文件后在这里等齐, 主线程过了barrier才开始计时
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void file_path(char *buf, size_t len, const char *dir, const char *prefix, int i)
+{
+    snprintf(buf, len, "%s/%s%d", dir, prefix, i);
+}
+
+// 建好nfiles个空文件, stat/unlink/readdir的准备工作, 不计时
+static int prepare_files(struct bench_opts *o, const char *prefix)
+{
+    int i, fd;
+    char path[512];
+
+    for (i = 0; i < o->nfiles; i++) {
+        file_path(path, sizeof(path), o->dir, prefix, i);
+        fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "arcobench: create %s failed: %s\n", path, strerror(errno));
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static void cleanup_files(struct bench_opts *o, const char *prefix)
+{
+    int i;
+    char path[512];
+
+    for (i = 0; i < o->nfiles; i++) {
+        file_path(path, sizeof(path), o->dir, prefix, i);
+        unlink(path);
+    }
+}
+
+// 元数据负载单线程跑, 每轮对nfiles个文件各做一次操作
+// 每轮之间有不计时的建/删文件, 所以总耗时按每次操作的延迟累加, 不用墙上时间
+static int run_meta(struct bench_opts *o, struct bench_thread *t)
+{
+    int r, i, fd, ret = 0;
+    char path[512];
+    struct stat st;
+    uint64_t start;
+    DIR *d;
+
+    if (strcmp(o->workload, "create") && prepare_files(o, "m"))
+        return -1;
+
+    for (r = 0; r < o->iters; r++) {
+        if (!strcmp(o->workload, "readdir")) {
+            start = now_ns();
+            d = opendir(o->dir);
+            if (!d) {
+                fprintf(stderr, "arcobench: opendir %s failed: %s\n", o->dir, strerror(errno));
+                ret = -1;
+                break;
+            }
+            while (readdir(d))
+                ;
+            closedir(d);
+            t->lat[t->nlat++] = now_ns() - start;
+            continue;
+        }
+
+        for (i = 0; i < o->nfiles; i++) {
+            file_path(path, sizeof(path), o->dir, "m", i);
+            start = now_ns();
+            if (!strcmp(o->workload, "create")) {
+                fd = open(path, O_CREAT | O_WRONLY, 0644);
+                ret = fd < 0 ? -1 : close(fd);
+            }
+            else if (!strcmp(o->workload, "stat")) {
+                ret = stat(path, &st);
+            }
+            else {
+                ret = unlink(path);
+            }
+            t->lat[t->nlat++] = now_ns() - start;
+            if (ret) {
+                fprintf(stderr, "arcobench: %s %s failed: %s\n", o->workload, path, strerror(errno));
+                return -1;
+            }
+        }
+
+        // 建完删掉/删完补上, 下一轮还是同样的目录状态; 这部分不计时
+        if (!strcmp(o->workload, "create"))
+            cleanup_files(o, "m");
+        else if (!strcmp(o->workload, "unlink") && prepare_files(o, "m"))
+            return -1;
+    }
+
+    cleanup_files(o, "m");
+    return ret;
+}
+
+// 每个线程读写自己的文件, 多线程时就是并发写不同文件
+static void *io_thread(void *arg)
+{
+    int r, i, fd, nblk;
+    long off;
+    ssize_t n;
+    char path[512];
+    char *buf;
+    uint64_t start;
+    unsigned int seed;
+    struct bench_thread *t = arg;
+    struct bench_opts *o = t->opts;
+    int rd = !strcmp(o->workload, "read");
+
+    buf = malloc(o->bs);
+    if (!buf) {
+        t->err = ENOMEM;
+        return NULL;
+    }
+    memset(buf, 'a' + t->idx % 26, o->bs);
+    seed = t->idx + 1;
+    nblk = o->size / o->bs;
+
+    file_path(path, sizeof(path), o->dir, "w", t->idx);
+    fd = open(path, O_CREAT | O_RDWR, 0644);
+    if (fd < 0)
+        t->err = errno;
+    // 读之前先把文件写满, 不计时
+    for (i = 0; rd && fd >= 0 && i < nblk; i++) {
+        if (pwrite(fd, buf, o->bs, (long)i * o->bs) != o->bs) {
+            t->err = errno ? errno : EIO;
+            break;
+        }
+    }
+
+    // 出错的线程也要到barrier, 否则别的线程会一直等
+    pthread_barrier_wait(&start_barrier);
+    if (fd < 0)
+        goto out;
+    if (t->err)
+        goto out_close;
+
+    for (r = 0; r < o->iters; r++) {
+        for (i = 0; i < nblk; i++) {
+            off = (long)(o->random ? rand_r(&seed) % nblk : i) * o->bs;
+            start = now_ns();
+            n = rd ? pread(fd, buf, o->bs, off) : pwrite(fd, buf, o->bs, off);
+            t->lat[t->nlat++] = now_ns() - start;
+            if (n != o->bs) {
+                t->err = n < 0 ? errno : EIO;
+                goto out_close;
+            }
+            t->bytes += n;
+        }
+    }
+    t->end = now_ns();
+
+out_close:
+    close(fd);
+    unlink(path);
+out:
+    free(buf);
+    return NULL;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: arcobench [-n iters] [-f files] [-t threads] [-b bs] [-s size] [-r] dir "
+                    "create|stat|unlink|readdir|write|read\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int opt, i, io, ret = 0;
+    long per, total = 0, bytes = 0;
+    uint64_t start, elapsed, *lat;
+    double secs;
+    struct bench_thread *threads;
+    struct bench_opts o = {
+        .iters = 100, .nfiles = ARCOFS_MAX_FILES, .threads = 1,
+        .bs = 1024, .size = ARCOFS_MAX_FILE_SIZE, .random = 0,
+    };
+
+    while ((opt = getopt(argc, argv, "n:f:t:b:s:r")) != -1) {
+        switch (opt) {
+        case 'n': o.iters = atoi(optarg); break;
+        case 'f': o.nfiles = atoi(optarg); break;
+        case 't': o.threads = atoi(optarg); break;
+        case 'b': o.bs = atoi(optarg); break;
+        case 's': o.size = atoi(optarg); break;
+        case 'r': o.random = 1; break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+        return -1;
+    }
+    o.dir = argv[optind];
+    o.workload = argv[optind + 1];
+
+    io = !strcmp(o.workload, "write") || !strcmp(o.workload, "read");
+    if (!io && strcmp(o.workload, "create") && strcmp(o.workload, "stat") &&
+        strcmp(o.workload, "unlink") && strcmp(o.workload, "readdir")) {
+        usage();
+        return -1;
+    }
+    if (o.iters <= 0 || o.nfiles <= 0 || o.nfiles > ARCOFS_MAX_FILES || o.threads <= 0 ||
+        o.threads > ARCOFS_MAX_FILES || o.bs <= 0 || o.size < o.bs || o.size > ARCOFS_MAX_FILE_SIZE) {
+        fprintf(stderr, "arcobench: bad args, at most %d files/threads and %d bytes per file\n",
+                ARCOFS_MAX_FILES, ARCOFS_MAX_FILE_SIZE);
+        return -1;
+    }
+    // 元数据负载只用一个线程
+    if (!io)
+        o.threads = 1;
+
+    per = (long)o.iters * (io ? o.size / o.bs : (!strcmp(o.workload, "readdir") ? 1 : o.nfiles));
+    threads = calloc(o.threads, sizeof(*threads));
+    if (!threads)
+        return -1;
+    for (i = 0; i < o.threads; i++) {
+        threads[i].idx = i;
+        threads[i].opts = &o;
+        threads[i].lat = malloc(per * sizeof(uint64_t));
+        if (!threads[i].lat)
+            return -1;
+    }
+
+    // 只统计计时循环本身: io负载从所有线程准备好算到最后一个线程做完,
+    // 元数据负载是每次操作延迟的总和
+    elapsed = 0;
+    if (io) {
+        pthread_barrier_init(&start_barrier, NULL, o.threads + 1);
+        for (i = 0; i < o.threads; i++)
+            pthread_create(&threads[i].tid, NULL, io_thread, &threads[i]);
+        pthread_barrier_wait(&start_barrier);
+        start = now_ns();
+        for (i = 0; i < o.threads; i++) {
+            pthread_join(threads[i].tid, NULL);
+            if (threads[i].err) {
+                fprintf(stderr, "arcobench: thread %d failed: %s\n", i, strerror(threads[i].err));
+                ret = -1;
+            }
+            if (threads[i].end > start && threads[i].end - start > elapsed)
+                elapsed = threads[i].end - start;
+        }
+        pthread_barrier_destroy(&start_barrier);
+    }
+    else {
+        ret = run_meta(&o, &threads[0]);
+        for (i = 0; i < threads[0].nlat; i++)
+            elapsed += threads[0].lat[i];
+    }
+    if (ret)
+        return -1;
+    if (elapsed == 0)
+        elapsed = 1;
+
+    // 所有线程的延迟合在一起算分位数
+    for (i = 0; i < o.threads; i++)
+        total += threads[i].nlat;
+    lat = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (!lat)
+        return -1;
+    for (total = 0, i = 0; i < o.threads; i++) {
+        memcpy(lat + total, threads[i].lat, threads[i].nlat * sizeof(uint64_t));
+        total += threads[i].nlat;
+        bytes += threads[i].bytes;
+    }
+    qsort(lat, total, sizeof(uint64_t), cmp_u64);
+
+    secs = elapsed / 1e9;
+    printf("{\"workload\": \"%s%s\", \"tool\": \"arcobench\", \"threads\": %d, \"ops\": %ld, "
+           "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, "
+           "\"lat_p50_us\": %.3f, \"lat_p99_us\": %.3f}\n",
+           o.random ? "rand" : "", o.workload, o.threads, total,
+           secs, total / secs, bytes / secs / 1e6,
+           total ? lat[total / 2] / 1e3 : 0, total ? lat[(total * 99) / 100] / 1e3 : 0);
+
+    free(lat);
+    for (i = 0; i < o.threads; i++)
+        free(threads[i].lat);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,113 @@
+#!/bin/sh
+# 性能测试脚本, 需要root
+# 每个负载都重新格式化一个loop镜像再挂载, 保证每次的起点一样
+# 结果汇总成一个json, 每个负载一项: ops_per_sec / mb_per_sec / lat_p50_us / lat_p99_us
+#
+# 用法: bench/run.sh [-o result.json] [-n 轮数] [-g blocks_per_group] [-c]
+#   -c: mkarcofs -c, 新文件压缩存放
+# 依赖: fio, jq; arcobench用 make bench 编出来
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+TOP_DIR=$(dirname "$BENCH_DIR")
+IMG=/tmp/arcobench.img
+MNT=/tmp/arcobench.mnt
+BLOCKS=1024
+OUT=
+ITERS=200
+MKFS_OPTS=
+
+while getopts "o:n:g:c" opt; do
+    case $opt in
+    o) OUT=$OPTARG ;;
+    n) ITERS=$OPTARG ;;
+    g) MKFS_OPTS="$MKFS_OPTS -g $OPTARG" ;;
+    c) MKFS_OPTS="$MKFS_OPTS -c" ;;
+    *) echo "usage: $0 [-o result.json] [-n iters] [-g blocks_per_group] [-c]"; exit 1 ;;
+    esac
+done
+
+MKARCOFS=$TOP_DIR/mkarcofs
+ARCOBENCH=$BENCH_DIR/arcobench
+for f in "$MKARCOFS" "$ARCOBENCH"; do
+    [ -x "$f" ] || { echo "$f not found, run make && make bench first"; exit 1; }
+done
+command -v fio >/dev/null || { echo "fio not found"; exit 1; }
+command -v jq >/dev/null || { echo "jq not found"; exit 1; }
+
+# 模块没加载就加载当前目录编出来的
+grep -qw arcofs /proc/filesystems || insmod "$TOP_DIR/arcofs.ko"
+
+RESULTS=$(mktemp)
+PRINTK=$(cat /proc/sys/kernel/printk)
+trap 'umount $MNT 2>/dev/null; echo "$PRINTK" > /proc/sys/kernel/printk; rm -f $RESULTS' EXIT
+
+# 驱动里printk很多, 压测时别往控制台打, 退出时恢复
+echo "1       4       1       7" > /proc/sys/kernel/printk
+mkdir -p $MNT
+
+fresh_mount() {
+    umount $MNT 2>/dev/null || true
+    dd if=/dev/zero of=$IMG bs=1024 count=$BLOCKS 2>/dev/null
+    "$MKARCOFS" $MKFS_OPTS $IMG >/dev/null
+    mount -o loop -t arcofs $IMG $MNT
+}
+
+# 某个负载失败时记一条带error的结果, 其他负载照常跑, 最后退出码非0
+FAILED=0
+
+# fio: 文件最大8kb, 用psync走read/write(驱动没有read_iter/write_iter)
+# 转成和arcobench一样的字段
+run_fio() {
+    name=$1; rw=$2; dir=$3
+    fresh_mount
+    if ! { fio --name=$name --directory=$MNT --filename=fio0 --rw=$rw --bs=1k --size=8k \
+            --ioengine=psync --loops=$ITERS --output-format=json > $RESULTS.fio &&
+        jq -ce --arg w "$name" --arg d "$dir" '.jobs[0][$d] | {
+            workload: $w, tool: "fio", threads: 1, ops: .total_ios,
+            seconds: (.runtime / 1000), ops_per_sec: .iops, mb_per_sec: (.bw_bytes / 1e6),
+            lat_p50_us: (.clat_ns.percentile["50.000000"] / 1000),
+            lat_p99_us: (.clat_ns.percentile["99.000000"] / 1000)}' $RESULTS.fio > $RESULTS.one; }; then
+        echo "fio $name failed" >&2
+        jq -cn --arg w "$name" '{workload: $w, tool: "fio", error: "failed"}' > $RESULTS.one
+        FAILED=1
+    fi
+    cat $RESULTS.one >> $RESULTS
+    rm -f $RESULTS.fio $RESULTS.one
+}
+
+run_fio seqwrite write write
+run_fio seqread read read
+run_fio randwrite randwrite write
+run_fio randread randread read
+
+# arcobench的参数要放在挂载点前面, 负载名在最后; 成功时stdout只有一行json
+run_bench() {
+    wl=$1; shift
+    fresh_mount
+    if ! "$ARCOBENCH" -n $ITERS "$@" $MNT $wl > $RESULTS.one; then
+        echo "arcobench $wl $* failed" >&2
+        jq -cn --arg w "$wl" --arg a "$*" '{workload: $w, tool: "arcobench", args: $a, error: "failed"}' > $RESULTS.one
+        FAILED=1
+    fi
+    cat $RESULTS.one >> $RESULTS
+    rm -f $RESULTS.one
+}
+
+run_bench create
+run_bench stat
+run_bench unlink
+run_bench readdir
+run_bench write -t 1
+run_bench write -t 4
+run_bench write -t 4 -r
+run_bench read -t 4 -r
+
+umount $MNT
+
+jq -s --arg k "$(uname -r)" --arg m "$(md5sum "$TOP_DIR/arcofs.ko" | cut -d' ' -f1)" \
+    --arg o "$MKFS_OPTS" --argjson n $ITERS --argjson b $BLOCKS \
+    '{fs: "arcofs", kernel: $k, module_md5: $m, mkfs_opts: $o, image_blocks: $b, iters: $n, results: .}' \
+    $RESULTS > ${OUT:-/dev/stdout}
+exit $FAILED
@@ -5,9 +5,13 @@
 #include<sys/mman.h>
 #include<fcntl.h>
 #include<errno.h>
+#include<unistd.h>
 
 #define ARCOFS_BLOCK_SIZE 1024
 #define ARCOFS_MAGIC   0x27266673 // 0x6673 is the ascii of 'fs'
+#define ARCOFS_FIRST_DATA_BLOCK 5
+#define ARCOFS_SB_COMPRESS 0x1 // s_flags: 新文件默认压缩
+#define ARCOFS_STATE_CLEAN 0x1 // s_state: 计数可信, 挂载时不用扫bytemap
 
 /*
  * description:
@@ -17,6 +21,10 @@
  * block 3: inode bitmap
  * block 4: inode table
  * block 5+ data area
+ *
+ * the volume is split into allocation groups of blocks_per_group blocks,
+ * group 0 uses block 2 as its block bytemap, group g>0 uses its own
+ * first block (g * blocks_per_group)
 */
 
 struct arcofs_super_block {
@@ -25,7 +33,11 @@ struct arcofs_super_block {
     int s_free_inodes_count;
     int s_blocks_count;
     int s_free_blocks_count;
-    char pad[1004];
+    int s_last_orphan;  // orphan链表头: 已unlink但还没释放的inode
+    int s_blocks_per_group; // 每个分配组的块数
+    int s_flags;            // ARCOFS_SB_COMPRESS: 新文件默认压缩
+    int s_state;            // ARCOFS_STATE_CLEAN: 正常卸载
+    char pad[988];
 };
 
 struct arcofs_inode {
@@ -33,7 +45,9 @@ struct arcofs_inode {
     /*04*/ int i_size;
     /*08*/ int i_block[8];
     /*40*/ char filename[12];
-    /*52*/ char pad[12];
+    /*52*/ int i_next_orphan; // orphan链表里的下一个ino
+    /*56*/ int i_flags;       // ARCOFS_COMPR_FL: 数据按cluster压缩存放
+    /*60*/ char pad[4];
 };
 
 struct arcofs_bytemap {
@@ -43,13 +57,33 @@ struct arcofs_bytemap {
 int main(int argc, char* argv[])
 {
     char filename[256];
+    int opt, compress = 0, blocks_per_group = ARCOFS_BLOCK_SIZE;
 
     /* 合法校验 */
-    if (argc != 2) {
+    // -g: 每个分配组的块数, 一个组的bytemap占1块, 所以最多1024
+    // -c: 卷上新建的文件默认压缩
+    while ((opt = getopt(argc, argv, "cg:")) != -1) {
+        switch (opt) {
+        case 'c':
+            compress = 1;
+            break;
+        case 'g':
+            blocks_per_group = atoi(optarg);
+            break;
+        default:
+            printf("usage: mkarcofs [-c] [-g blocks_per_group] image\n");
+            return -1;
+        }
+    }
+    if (argc - optind != 1) {
         printf("mkarcofs: arg num error\n");
         return -1;
     }
-    strcpy(filename, argv[1]);
+    if (blocks_per_group <= ARCOFS_FIRST_DATA_BLOCK || blocks_per_group > ARCOFS_BLOCK_SIZE) {
+        printf("mkarcofs: blocks per group must be in (%d, %d]\n", ARCOFS_FIRST_DATA_BLOCK, ARCOFS_BLOCK_SIZE);
+        return -1;
+    }
+    strcpy(filename, argv[optind]);
     struct stat st;
     if (stat(filename, &st) != 0) {
         printf("mkarcofs: file %s is not exist\n", filename);
@@ -69,23 +103,28 @@ int main(int argc, char* argv[])
 
 
     /* 使用mmap映射文件到内存 */
-    int fd, maplen = st.st_size, block_num;
+    int fd, maplen = st.st_size, block_num, total_blocks, groups_count, g, i;
     void* start = NULL;
+    void* base = NULL;
     fd = open(filename, O_RDWR);
     if (fd <= 0) {
         printf("mkarcofs: open %s failed\n", filename);
         return -1;
     }
     start = (char*)mmap(NULL, maplen, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-    if (start <= 0) {
+    if (start == MAP_FAILED) {
         printf("mkarcofs: mmap failed errno:%s\n", strerror(errno));
+        return -1;
     }
+    base = start;
     // 跳过reserved块
     start += ARCOFS_BLOCK_SIZE;
 
     /* 计算可分配的block数量 */
     block_num = st.st_size / 1024 - 1;
-    printf("mkarcofs: block_num=%d\n", block_num);
+    total_blocks = block_num + 1;
+    groups_count = (total_blocks + blocks_per_group - 1) / blocks_per_group;
+    printf("mkarcofs: block_num=%d groups=%d blocks_per_group=%d\n", block_num, groups_count, blocks_per_group);
 
     /* 格式化super_block */
     struct arcofs_super_block *sb = malloc(sizeof(struct arcofs_super_block));
@@ -93,7 +132,11 @@ int main(int argc, char* argv[])
     sb->s_inodes_count = (ARCOFS_BLOCK_SIZE / sizeof(struct arcofs_inode));
     sb->s_free_inodes_count = sb->s_inodes_count - 2; // .和..
     sb->s_blocks_count = block_num - 4;
-    sb->s_free_blocks_count = block_num - 4;
+    sb->s_free_blocks_count = block_num - 4 - (groups_count - 1); // 组1之后每个组占掉1块做bytemap
+    sb->s_last_orphan = 0;
+    sb->s_blocks_per_group = blocks_per_group;
+    sb->s_flags = compress ? ARCOFS_SB_COMPRESS : 0;
+    sb->s_state = ARCOFS_STATE_CLEAN; // 刚格式化完的计数是准的
     memset(sb->pad, 0, sizeof(sb->pad));
     printf("start addr:%p\n", start);
     printf("sb addr:%p\n", sb);
@@ -101,11 +144,23 @@ int main(int argc, char* argv[])
     memcpy(start, sb, sizeof(struct arcofs_super_block));
     start += ARCOFS_BLOCK_SIZE;
 
-    /* 格式化block bitmap */
-    memset(start, 1, ARCOFS_BLOCK_SIZE); // memset按uchar填充
-    struct arcofs_bytemap *blockmap = (struct arcofs_bytemap*)start;
-    blockmap->idx[0] = 2;
-    blockmap->idx[1] = 2;
+    /* 格式化各分配组的block bitmap */
+    for (g = 0; g < groups_count; g++) {
+        int map_block = g ? g * blocks_per_group : 2;
+        struct arcofs_bytemap *blockmap = (struct arcofs_bytemap*)(base + map_block * ARCOFS_BLOCK_SIZE);
+
+        // 组内的块默认空闲, 卷末尾以外的项和组的元数据块标记为已占用
+        memset(blockmap, 2, ARCOFS_BLOCK_SIZE); // memset按uchar填充
+        for (i = 0; i < blocks_per_group && g * blocks_per_group + i < total_blocks; i++)
+            blockmap->idx[i] = 1;
+        if (g == 0) {
+            for (i = 0; i < ARCOFS_FIRST_DATA_BLOCK; i++)
+                blockmap->idx[i] = 2;
+        }
+        else {
+            blockmap->idx[0] = 2;
+        }
+    }
     start += ARCOFS_BLOCK_SIZE;
 
     /* 格式化inode bitmap */
@@ -122,6 +177,8 @@ int main(int argc, char* argv[])
     node_dot->i_mode = S_IFDIR;
     strcpy(node_dot->filename, ".");
     memset(node_dot->i_block, 0, sizeof(node_dot->i_block));
+    node_dot->i_next_orphan = 0;
+    node_dot->i_flags = 0;
     memset(node_dot->pad, 0, sizeof(node_dot->pad));
     memcpy(start, node_dot, sizeof(struct arcofs_inode));
     start += sizeof(struct arcofs_inode);
@@ -131,10 +188,12 @@ int main(int argc, char* argv[])
     node_dotdot->i_mode = S_IFDIR;
     strcpy(node_dotdot->filename, "..");
     memset(node_dotdot->i_block, 0, sizeof(node_dotdot->i_block));
+    node_dotdot->i_next_orphan = 0;
+    node_dotdot->i_flags = 0;
     memset(node_dotdot->pad, 0, sizeof(node_dotdot->pad));
     memcpy(start, node_dotdot, sizeof(struct arcofs_inode));
     start += sizeof(struct arcofs_inode);
 
-    munmap(start, maplen);
+    munmap(base, maplen);
     return 0;
 }
\ No newline at end of file